@@ -0,0 +1,322 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../http.h"
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Microbenchmarks for request parsing hot paths. Results are printed to
+ * stdout, one line per benchmark. */
+
+#define BOUNDARY "----slclbench7MA4YWxkTrZu0gW"
+
+enum
+{
+    /* Upload size, in bytes, and times it is sent. */
+    UPLOAD_LEN = 64 * 1024 * 1024,
+    UPLOAD_RUNS = 4,
+    URL_RUNS = 2000000
+};
+
+/* Requests are read from memory, and responses are discarded. */
+struct bench
+{
+    const char *buf;
+    size_t len, off;
+    unsigned long long written;
+    bool done;
+};
+
+static FILE *out;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts))
+    {
+        perror("clock_gettime");
+        exit(EXIT_FAILURE);
+    }
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int on_read(void *const buf, const size_t n, void *const user)
+{
+    struct bench *const b = user;
+    const size_t rem = b->len - b->off, r = n < rem ? n : rem;
+
+    memcpy(buf, b->buf + b->off, r);
+    b->off += r;
+    return r;
+}
+
+static int on_write(const void *const buf, const size_t n, void *const user)
+{
+    return n;
+}
+
+static int on_writev(const struct iovec *const iov, const int n,
+    void *const user)
+{
+    int ret = 0;
+
+    for (int i = 0; i < n; i++)
+        ret += iov[i].iov_len;
+
+    return ret;
+}
+
+/* Uploads are counted rather than written, so that the benchmark does not
+ * depend on disk throughput. */
+static int on_pwrite(const int fd, const void *const buf, const size_t n,
+    const off_t off, void *const user)
+{
+    struct bench *const b = user;
+
+    b->written += n;
+    return 0;
+}
+
+static int on_payload(const struct http_payload *const p,
+    struct http_response *const r, void *const user)
+{
+    struct bench *const b = user;
+
+    b->done = true;
+    *r = (const struct http_response)
+    {
+        .status = HTTP_STATUS_SEE_OTHER
+    };
+
+    return 0;
+}
+
+static int on_length(const unsigned long long len,
+    const struct http_cookie *const c, struct http_response *const r,
+    void *const user)
+{
+    return 0;
+}
+
+/* Sends b->buf as a request, until its response is written. */
+static int run(struct http_ctx *const h, struct bench *const b)
+{
+    bool write = false, close = false;
+
+    b->off = 0;
+    b->done = false;
+
+    while (!b->done || write)
+    {
+        const int ret = http_update(h, &write, &close);
+
+        if (ret || close)
+        {
+            fprintf(stderr, "%s: http_update failed\n", __func__);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* fill writes n bytes of file data into buf. */
+static int bench_upload(const char *const name,
+    void (*const fill)(char *buf, size_t n))
+{
+    static const char head[] =
+        "POST /upload HTTP/1.1\r\n"
+        "Content-Type: multipart/form-data; boundary=" BOUNDARY "\r\n"
+        "Content-Length: %zu\r\n"
+        "\r\n",
+        part[] =
+        "--" BOUNDARY "\r\n"
+        "Content-Disposition: form-data; name=\"file\"; filename=\"f\"\r\n"
+        "Content-Type: application/octet-stream\r\n"
+        "\r\n",
+        end[] = "\r\n--" BOUNDARY "--\r\n";
+    const size_t body = strlen(part) + UPLOAD_LEN + strlen(end),
+        max = sizeof head + sizeof "18446744073709551615" + body;
+    int ret = -1;
+    char *const buf = malloc(max);
+    struct bench b = {0};
+    struct http_ctx *h = NULL;
+
+    if (!buf)
+    {
+        perror("malloc");
+        goto end;
+    }
+
+    const int n = sprintf(buf, head, body);
+    char *p = buf + n;
+
+    p += sprintf(p, "%s", part);
+    fill(p, UPLOAD_LEN);
+    p += UPLOAD_LEN;
+    p += sprintf(p, "%s", end);
+    b.buf = buf;
+    b.len = p - buf;
+
+    const struct http_cfg cfg =
+    {
+        .read = on_read,
+        .write = on_write,
+        .writev = on_writev,
+        .pwrite = on_pwrite,
+        .payload = on_payload,
+        .length = on_length,
+        .tmpdir = "/tmp",
+        .user = &b
+    };
+
+    if (!(h = http_alloc(&cfg)))
+    {
+        fprintf(stderr, "%s: http_alloc failed\n", __func__);
+        goto end;
+    }
+
+    const double start = now();
+
+    for (int i = 0; i < UPLOAD_RUNS; i++)
+        if (run(h, &b))
+        {
+            fprintf(stderr, "%s: run failed\n", __func__);
+            goto end;
+        }
+
+    const double t = now() - start;
+
+    if (b.written != (unsigned long long)UPLOAD_LEN * UPLOAD_RUNS)
+    {
+        fprintf(stderr, "%s: expected %llu bytes, got %llu\n", __func__,
+            (unsigned long long)UPLOAD_LEN * UPLOAD_RUNS, b.written);
+        goto end;
+    }
+
+    fprintf(out, "multipart %-12s %8.1f MiB/s\n", name,
+        (double)UPLOAD_LEN * UPLOAD_RUNS / t / (1024 * 1024));
+    ret = 0;
+
+end:
+    http_free(h);
+    free(buf);
+    return ret;
+}
+
+/* Binary data, where a CR shows up every 256 bytes on average. */
+static void fill_random(char *const buf, const size_t n)
+{
+    unsigned long x = 88172645463325252ul;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        buf[i] = x >> 24;
+    }
+}
+
+/* Text with CRLF line endings, where every line looks like the start of
+ * the boundary, so every candidate must be compared. */
+static void fill_lines(char *const buf, const size_t n)
+{
+    static const char line[] = "\r\n--" "----slclbench7MA4YWxkTrZu0gX"
+        " almost a boundary, but not quite";
+
+    for (size_t i = 0; i < n; i += sizeof line - 1)
+    {
+        const size_t rem = n - i;
+
+        memcpy(&buf[i], line, rem < sizeof line - 1 ? rem : sizeof line - 1);
+    }
+}
+
+static void report(const char *const name, const size_t len,
+    const double t)
+{
+    fprintf(out, "%-22s %8.1f MiB/s %8.1f ns/op\n", name,
+        (double)len * URL_RUNS / t / (1024 * 1024), t * 1e9 / URL_RUNS);
+}
+
+/* A path to a user file, as found in links from directory listings. */
+static int bench_url(void)
+{
+    static const char url[] = "/user/Documents/Photos 2024/"
+        "Vacaciones en la playa \xe2\x80\x93 d\xc3\xad" "a 1/IMG_0001 (1).jpg";
+    char enc[3 * sizeof url], dec[sizeof enc];
+    const size_t n = http_encode_url(url, enc, sizeof enc);
+    size_t sink = 0;
+
+    if (n >= sizeof enc)
+    {
+        fprintf(stderr, "%s: http_encode_url failed\n", __func__);
+        return -1;
+    }
+
+    double start = now();
+
+    for (int i = 0; i < URL_RUNS; i++)
+        sink += http_encode_url(url, enc, sizeof enc);
+
+    const double te = now() - start;
+
+    start = now();
+
+    /* Decoding is done in place, so the encoded URL is copied first. */
+    for (int i = 0; i < URL_RUNS; i++)
+    {
+        memcpy(dec, enc, n + 1);
+
+        if (http_decode_url(dec, false))
+        {
+            fprintf(stderr, "%s: http_decode_url failed\n", __func__);
+            return -1;
+        }
+
+        sink += dec[0];
+    }
+
+    const double td = now() - start;
+
+    if (strcmp(dec, url) || !sink)
+    {
+        fprintf(stderr, "%s: decoded URL differs: %s\n", __func__, dec);
+        return -1;
+    }
+
+    report("url encode", strlen(url), te);
+    report("url decode", n, td);
+    return 0;
+}
+
+int main(void)
+{
+    /* http.c logs every request line to stdout, so results are written to
+     * a copy of it, and stdout itself is discarded. */
+    if (!(out = fdopen(dup(fileno(stdout)), "w")))
+    {
+        perror("fdopen");
+        return EXIT_FAILURE;
+    }
+    else if (!freopen("/dev/null", "w", stdout))
+    {
+        perror("freopen");
+        return EXIT_FAILURE;
+    }
+    else if (bench_upload("random", fill_random)
+        || bench_upload("near-misses", fill_lines)
+        || bench_url())
+        return EXIT_FAILURE;
+
+    return fclose(out) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
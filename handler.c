@@ -1,15 +1,29 @@
 #define _POSIX_C_SOURCE 200809L
 
 #include "handler.h"
+#include "handoff.h"
 #include "http.h"
 #include "server.h"
+#include "twheel.h"
 #include "wildcard_cmp.h"
+#include "wpool.h"
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+
+/* Resolution of connection timeouts, in milliseconds. */
+enum {TICK_MS = 100};
+
+/* Seconds rejected clients are asked to wait before retrying. */
+#define RETRY_AFTER "5"
 
 struct handler
 {
@@ -19,19 +33,86 @@ struct handler
         char *url;
         enum http_op op;
         handler_fn f;
+        handler_async_fn af;
         void *user;
     } *elem;
 
-    struct server *server;
-    struct client
+    struct wpool *wpool;
+
+    /* Waits for a new process to take over the listening sockets. */
+    pthread_t handoff_thread;
+    int handoff_fd;
+    bool handoff_started, handed_off;
+
+    /* Admission control counters, shared among shards and protected by
+     * mutex. */
+    pthread_mutex_t mutex;
+    unsigned long n_clients, n_uploads, upload_bytes;
+
+    /* Each shard runs its own event loop on its own thread, with its own
+     * listening socket and connection table. Only h is shared among
+     * shards, which is read-only once handler_listen is called, except
+     * for the admission control counters above. */
+    struct shard
     {
         struct handler *h;
-        struct server_client *c;
-        struct http_ctx *http;
-        struct client *next;
-    } *clients;
+        struct server *server;
+        pthread_t thread;
+        int ret;
+
+        /* Workers and asynchronous handlers notify finished jobs by
+         * writing their client into a socket, which is polled along with
+         * the rest of clients. */
+        struct server_client *done;
+        int done_fd;
+
+        /* Connection timeouts, measured in ticks since an arbitrary
+         * point. tick is updated on every wakeup. */
+        struct twheel *timers;
+        unsigned long long tick;
+
+        /* Set once the listening socket is handed over, so that the shard
+         * exits when its clients are done or on deadline, if non-zero. */
+        bool draining;
+        unsigned long long deadline;
 
-    size_t n_cfg;
+        /* Released clients are kept into a free list, so their http_ctx
+         * can be recycled by new connections. */
+        struct client
+        {
+            struct shard *s;
+            struct server_client *c;
+            struct http_ctx *http;
+            struct client *prev, *next;
+            struct twheel_timer timer;
+            enum http_phase phase;
+            /* syncing is set while the handler for c->job waits for
+             * uploads to be written. */
+            bool suspended, uploading, syncing;
+            /* Length reserved for the current upload, if any. */
+            unsigned long long upload;
+
+            /* Handler or length callback, possibly run by a worker. */
+            struct job
+            {
+                const struct elem *e;
+                const struct http_payload *p;
+                const struct http_cookie *cookie;
+                unsigned long long len;
+                struct http_response *r;
+                int ret;
+            } job;
+
+            struct handler_token
+            {
+                struct client *c;
+            } token;
+        } *clients, *free;
+
+        size_t n_free;
+    } *shards;
+
+    size_t n_cfg, n_shards;
 };
 
 static int on_read(void *const buf, const size_t n, void *const user)
@@ -48,18 +129,157 @@ static int on_write(const void *const buf, const size_t n, void *const user)
     return server_write(buf, n, c->c);
 }
 
+static int on_writev(const struct iovec *const iov, const int n,
+    void *const user)
+{
+    struct client *const c = user;
+
+    return server_writev(iov, n, c->c);
+}
+
+static int on_sendfile(const int fd, off_t *const off, const size_t n,
+    void *const user)
+{
+    struct client *const c = user;
+
+    return server_sendfile(fd, off, n, c->c);
+}
+
+static int on_pwrite(const int fd, const void *const buf, const size_t n,
+    const off_t off, void *const user)
+{
+    struct client *const c = user;
+
+    return server_pwrite(fd, buf, n, off, c->c);
+}
+
+static int call_job(const struct client *const c)
+{
+    const struct job *const j = &c->job;
+    const struct handler *const h = c->s->h;
+
+    if (j->e)
+        return j->e->f(j->p, j->r, j->e->user);
+
+    return h->cfg.length(j->len, j->cookie, j->r, h->cfg.user);
+}
+
+static void notify_done(struct client *const c, const int ret)
+{
+    c->job.ret = ret;
+
+    if (write(c->s->done_fd, &c, sizeof c) != sizeof c)
+        fprintf(stderr, "%s: write(2): %s\n", __func__, strerror(errno));
+}
+
+static void run_job(void *const arg)
+{
+    struct client *const c = arg;
+
+    notify_done(c, call_job(c));
+}
+
+/* Workers might still refer to suspended clients, so they never time
+ * out. */
+static void suspend(struct client *const c)
+{
+    http_suspend(c->http);
+    server_client_suspend(c->c, true);
+    twheel_cancel(&c->timer);
+    c->suspended = true;
+}
+
+/* Runs c->job on the worker pool, if available, so that blocking
+ * operations do not stall the rest of connections. c is suspended until
+ * the job is finished. */
+static int push_job(struct client *const c)
+{
+    struct wpool *const p = c->s->h->wpool;
+    int res;
+
+    if (!p)
+        return call_job(c);
+    else if ((res = wpool_push(p, run_job, c)) < 0)
+    {
+        fprintf(stderr, "%s: wpool_push failed\n", __func__);
+        return -1;
+    }
+    /* Fall back to the event loop if the queue is full. */
+    else if (res)
+        return call_job(c);
+
+    suspend(c);
+    return 0;
+}
+
+/* Asynchronous handlers must not block, so they run on the event loop. */
+static int call_async(struct client *const c, const struct elem *const e,
+    const struct http_payload *const p, struct http_response *const r)
+{
+    const int ret = e->af(p, r, &c->token, e->user);
+
+    if (ret == HANDLER_PENDING)
+    {
+        suspend(c);
+        return 0;
+    }
+
+    return ret;
+}
+
+void handler_complete(struct handler_token *const t, const int ret)
+{
+    notify_done(t->c, ret);
+}
+
+static int dispatch(struct client *const c)
+{
+    const struct job *const j = &c->job;
+
+    if (j->e->af)
+        return call_async(c, j->e, j->p, j->r);
+
+    return push_job(c);
+}
+
 static int on_payload(const struct http_payload *const p,
     struct http_response *const r, void *const user)
 {
     struct client *const c = user;
-    struct handler *const h = c->h;
+    const struct handler *const h = c->s->h;
 
     for (size_t i = 0; i < h->n_cfg; i++)
     {
         const struct elem *const e = &h->elem[i];
 
-        if (e->op == p->op && !wildcard_cmp(p->resource, e->url, true))
-            return e->f(p, r, e->user);
+        if (e->op != p->op || wildcard_cmp(p->resource, e->url, true))
+            continue;
+
+        c->job = (const struct job)
+        {
+            .e = e,
+            .p = p,
+            .r = r
+        };
+
+        /* Uploads might still be written in the background, so handlers
+         * are run once they are complete, from update_client. */
+        const int res = server_client_sync(c->c);
+
+        if (res < 0)
+        {
+            fprintf(stderr, "%s: server_client_sync failed\n", __func__);
+            return -1;
+        }
+        else if (res)
+        {
+            http_suspend(c->http);
+            twheel_cancel(&c->timer);
+            c->suspended = c->syncing = true;
+            return 0;
+        }
+
+        return dispatch(c);
     }
 
     fprintf(stderr, "Not found: %s\n", p->resource);
@@ -72,31 +292,127 @@ static int on_payload(const struct http_payload *const p,
     return 0;
 }
 
+/* A zero limit means no limit, so no counters are kept. */
+static bool admit_client(struct handler *const h)
+{
+    const unsigned long max = h->cfg.limits.clients;
+    bool ret;
+
+    if (!max)
+        return true;
+
+    pthread_mutex_lock(&h->mutex);
+
+    if ((ret = h->n_clients < max))
+        h->n_clients++;
+
+    pthread_mutex_unlock(&h->mutex);
+    return ret;
+}
+
+static void release_client(struct handler *const h)
+{
+    if (h->cfg.limits.clients)
+    {
+        pthread_mutex_lock(&h->mutex);
+        h->n_clients--;
+        pthread_mutex_unlock(&h->mutex);
+    }
+}
+
+static bool admit_upload(struct client *const c,
+    const unsigned long long len)
+{
+    struct handler *const h = c->s->h;
+    const struct handler_limits *const l = &h->cfg.limits;
+    bool ret;
+
+    if (!l->uploads && !l->upload_bytes)
+        return true;
+
+    pthread_mutex_lock(&h->mutex);
+
+    if ((ret = (!l->uploads || h->n_uploads < l->uploads)
+        && (!l->upload_bytes || len <= l->upload_bytes - h->upload_bytes)))
+    {
+        h->n_uploads++;
+        h->upload_bytes += len;
+        c->upload = len;
+        c->uploading = true;
+    }
+
+    pthread_mutex_unlock(&h->mutex);
+    return ret;
+}
+
+static void release_upload(struct client *const c)
+{
+    struct handler *const h = c->s->h;
+
+    if (c->uploading)
+    {
+        pthread_mutex_lock(&h->mutex);
+        h->n_uploads--;
+        h->upload_bytes -= c->upload;
+        pthread_mutex_unlock(&h->mutex);
+        c->uploading = false;
+    }
+}
+
+static int unavailable(struct http_response *const r)
+{
+    *r = (const struct http_response)
+    {
+        .status = HTTP_STATUS_SERVICE_UNAVAILABLE
+    };
+
+    if (http_response_add_header(r, "Retry-After", RETRY_AFTER))
+    {
+        fprintf(stderr, "%s: http_response_add_header failed\n", __func__);
+        return -1;
+    }
+
+    return 1;
+}
+
 static int on_length(const unsigned long long len,
     const struct http_cookie *const c, struct http_response *const r,
     void *const user)
 {
     struct client *const cl = user;
-    struct handler *const h = cl->h;
+    const struct handler *const h = cl->s->h;
+
+    /* Uploads are rejected before their body is read, so that neither
+     * memory nor tmpdir are used. */
+    if (!admit_upload(cl, len))
+        return unavailable(r);
+    else if (h->cfg.length)
+    {
+        cl->job = (const struct job)
+        {
+            .cookie = c,
+            .len = len,
+            .r = r
+        };
 
-    if (h->cfg.length)
-        return h->cfg.length(len, c, r, h->cfg.user);
+        return push_job(cl);
+    }
 
     return 0;
 }
 
-static struct client *find_or_alloc_client(struct handler *const h,
-    struct server_client *const c)
+static struct client *alloc_client(struct shard *const s)
 {
-    for (struct client *cl = h->clients; cl; cl = cl->next)
+    struct client *ret;
+
+    if (s->free)
     {
-        if (cl->c == c)
-            return cl;
+        ret = s->free;
+        s->free = ret->next;
+        s->n_free--;
+        return ret;
     }
-
-    struct client *const ret = malloc(sizeof *ret);
-
-    if (!ret)
+    else if (!(ret = malloc(sizeof *ret)))
     {
         fprintf(stderr, "%s: malloc(3): %s\n", __func__, strerror(errno));
         return NULL;
@@ -106,37 +422,60 @@ static struct client *find_or_alloc_client(struct handler *const h,
     {
         .read = on_read,
         .write = on_write,
+        .writev = on_writev,
+        .sendfile = on_sendfile,
+        .pwrite = on_pwrite,
         .payload = on_payload,
         .length = on_length,
         .user = ret,
-        .tmpdir = h->cfg.tmpdir
+        .tmpdir = s->h->cfg.tmpdir,
+        .form_bytes = s->h->cfg.limits.form_bytes,
+        .max_requests = s->h->cfg.limits.requests
     };
 
     *ret = (const struct client)
     {
-        .c = c,
-        .h = h,
-        .http = http_alloc(&cfg)
+        .s = s,
+        .http = http_alloc(&cfg),
+        .token.c = ret,
+        .timer.user = ret
     };
 
     if (!ret->http)
     {
         fprintf(stderr, "%s: http_alloc failed\n", __func__);
+        free(ret);
         return NULL;
     }
 
-    if (!h->clients)
-        h->clients = ret;
-    else
+    return ret;
+}
+
+static struct client *find_or_alloc_client(struct shard *const s,
+    struct server_client *const c)
+{
+    struct client *const cl = server_client_user(c);
+
+    if (cl)
+        return cl;
+
+    struct client *const ret = alloc_client(s);
+
+    if (!ret)
     {
-        for (struct client *c = h->clients; c; c = c->next)
-            if (!c->next)
-            {
-                c->next = ret;
-                break;
-            }
+        fprintf(stderr, "%s: alloc_client failed\n", __func__);
+        return NULL;
     }
 
+    ret->c = c;
+    ret->prev = NULL;
+    ret->next = s->clients;
+
+    if (s->clients)
+        s->clients->prev = ret;
+
+    s->clients = ret;
+    server_client_set_user(c, ret);
     return ret;
 }
 
@@ -148,109 +487,697 @@ static void client_free(struct client *const c)
     free(c);
 }
 
-static int remove_client_from_list(struct handler *const h,
+static int remove_client_from_list(struct shard *const s,
     struct client *const c)
 {
+    /* Maximum number of released clients kept for recycling. */
+    enum {MAX_FREE = 256};
     int ret = -1;
 
-    if (server_client_close(h->server, c->c))
+    twheel_cancel(&c->timer);
+    release_upload(c);
+    release_client(s->h);
+
+    if (server_client_close(s->server, c->c))
     {
         fprintf(stderr, "%s: server_client_close failed\n",
             __func__);
         goto end;
     }
 
-    for (struct client *cl = h->clients, *prev = NULL; cl;
-        prev = cl, cl = cl->next)
-    {
-        if (cl == c)
-        {
-            if (!prev)
-                h->clients = c->next;
-            else
-                prev->next = cl->next;
-
-            break;
-        }
-    }
-
     ret = 0;
 
 end:
-    client_free(c);
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        s->clients = c->next;
+
+    if (c->next)
+        c->next->prev = c->prev;
+
+    if (s->n_free < MAX_FREE)
+    {
+        http_reset(c->http);
+        c->next = s->free;
+        s->free = c;
+        s->n_free++;
+    }
+    else
+        client_free(c);
+
     return ret;
 }
 
-int handler_listen(struct handler *const h, const short port)
+static int get_tick(unsigned long long *const tick)
 {
-    if (!(h->server = server_init(port)))
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts))
     {
-        fprintf(stderr, "%s: server_init failed\n", __func__);
+        fprintf(stderr, "%s: clock_gettime(2): %s\n",
+            __func__, strerror(errno));
         return -1;
     }
 
-    for (;;)
+    *tick = (unsigned long long)ts.tv_sec * (1000 / TICK_MS)
+        + ts.tv_nsec / (TICK_MS * 1000000L);
+    return 0;
+}
+
+static unsigned long get_timeout(const struct handler_timeouts *const t,
+    const enum http_phase phase)
+{
+    switch (phase)
+    {
+        case HTTP_PHASE_IDLE:
+            return t->idle;
+
+        case HTTP_PHASE_HEADER:
+            return t->header;
+
+        case HTTP_PHASE_BODY:
+            return t->body;
+
+        case HTTP_PHASE_WRITE:
+            return t->write;
+    }
+
+    return 0;
+}
+
+/* Idle and header timeouts apply to the whole phase, whereas body and
+ * write timeouts are restarted whenever clients make progress, which is
+ * assumed whenever they are serviced. */
+static void update_timer(struct shard *const s, struct client *const c)
+{
+    if (c->suspended)
+        return;
+
+    const enum http_phase phase = http_phase(c->http);
+    const unsigned long timeout = get_timeout(&s->h->cfg.timeouts, phase);
+
+    if (!timeout)
+        twheel_cancel(&c->timer);
+    else if (phase != c->phase || !twheel_pending(&c->timer)
+        || phase == HTTP_PHASE_BODY || phase == HTTP_PHASE_WRITE)
     {
-        bool exit, io;
-        struct server_client *const c = server_poll(h->server, &io, &exit);
+        const unsigned long long ticks = timeout * (1000ull / TICK_MS);
+
+        twheel_add(s->timers, &c->timer, s->tick + ticks);
+    }
+
+    c->phase = phase;
+}
 
-        if (exit)
+static int process_result(struct shard *const s, struct client *const cl,
+    const int res, const bool write, const bool close)
+{
+    if (res || close)
+    {
+        if (res < 0)
         {
-            printf("Exiting...\n");
-            break;
+            fprintf(stderr, "%s: http_update failed\n", __func__);
+            return -1;
         }
-        else if (!c)
+        else if (remove_client_from_list(s, cl))
         {
-            fprintf(stderr, "%s: server_poll failed\n", __func__);
+            fprintf(stderr, "%s: remove_client_from_list failed\n",
+                __func__);
             return -1;
         }
+    }
+    else
+    {
+        server_client_write_pending(cl->c, write);
+        update_timer(s, cl);
+
+        if (http_phase(cl->http) == HTTP_PHASE_IDLE)
+            release_upload(cl);
+    }
+
+    return 0;
+}
+
+/* Listening sockets were handed over to another process, which accepts
+ * new connections from now on. */
+static int drain(struct shard *const s)
+{
+    const unsigned long timeout = s->h->cfg.timeouts.drain;
+
+    if (server_stop_accept(s->server))
+    {
+        fprintf(stderr, "%s: server_stop_accept failed\n", __func__);
+        return -1;
+    }
+    else if (timeout)
+        s->deadline = s->tick + timeout * (1000ull / TICK_MS);
+
+    s->draining = true;
+    return 0;
+}
+
+static int resume(struct shard *const s, struct client *const cl,
+    const int ret)
+{
+    bool write;
+    const int res = http_resume(cl->http, ret, &write);
+
+    cl->suspended = false;
+    server_client_write_pending(cl->c, write);
+    server_client_suspend(cl->c, false);
+    return process_result(s, cl, res, write, false);
+}
+
+static int complete_jobs(struct shard *const s)
+{
+    struct client *c[64];
+    const int r = server_read(c, sizeof c, s->done);
+
+    if (r < 0)
+        /* Not ready means no more jobs are available. */
+        return server_client_ready(s->done) ? -1 : 0;
+    else if (!r)
+    {
+        fprintf(stderr, "%s: unexpected end of file\n", __func__);
+        return -1;
+    }
 
-        struct client *const cl = find_or_alloc_client(h, c);
+    for (size_t i = 0; i < r / sizeof *c; i++)
+    {
+        struct client *const cl = c[i];
 
+        /* NULL is written by run_handoff. */
         if (!cl)
         {
-            fprintf(stderr, "%s: find_or_alloc_client failed\n", __func__);
-            return -1;
+            if (drain(s))
+            {
+                fprintf(stderr, "%s: drain failed\n", __func__);
+                return -1;
+            }
+
+            continue;
         }
-        else if (io)
+
+        if (resume(s, cl, cl->job.ret))
         {
-            bool write, close;
-            const int res = http_update(cl->http, &write, &close);
+            fprintf(stderr, "%s: resume failed\n", __func__);
+            return -1;
+        }
+    }
+
+    return 0;
+}
 
-            if (res || close)
+/* Uploads from cl were written, so its handler can be run. */
+static int end_sync(struct shard *const s, struct client *const cl)
+{
+    const int sync = server_client_sync(cl->c);
+
+    if (sync)
+    {
+        fprintf(stderr, "%s: server_client_sync failed\n", __func__);
+        return -1;
+    }
+
+    cl->suspended = cl->syncing = false;
+
+    const int ret = dispatch(cl);
+
+    return cl->suspended ? 0 : resume(s, cl, ret);
+}
+
+/* Rejected connections are not assigned any client, so a fixed response
+ * is written directly. Any data already received is read first, since
+ * closing a socket with unread data resets the connection, possibly
+ * before the response is read by the peer. */
+static int reject_client(struct shard *const s, struct server_client *const c)
+{
+    static const char resp[] = "HTTP/1.1 503 Service Unavailable\r\n"
+        "Retry-After: " RETRY_AFTER "\r\n"
+        "Content-Length: 0\r\n"
+        "Connection: close\r\n"
+        "\r\n";
+    char buf[1024];
+
+    /* Errors are ignored, since the connection is closed anyway. */
+    server_read(buf, sizeof buf, c);
+    server_write(resp, strlen(resp), c);
+
+    if (server_client_close(s->server, c))
+    {
+        fprintf(stderr, "%s: server_client_close failed\n", __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int update_client(struct shard *const s,
+    struct server_client *const c)
+{
+    if (c == s->done)
+        return complete_jobs(s);
+    else if (!server_client_user(c) && !admit_client(s->h))
+        return reject_client(s, c);
+
+    struct client *const cl = find_or_alloc_client(s, c);
+
+    if (!cl)
+    {
+        fprintf(stderr, "%s: find_or_alloc_client failed\n", __func__);
+        return -1;
+    }
+    else if (cl->syncing)
+        return end_sync(s, cl);
+
+    bool write, close;
+    const int res = http_update(cl->http, &write, &close);
+
+    return process_result(s, cl, res, write, close);
+}
+
+/* Services every ready client in a round-robin fashion until all of them
+ * would block or run out of budget, so that one wakeup moves every active
+ * transfer forward. */
+static int update_clients(struct shard *const s,
+    struct server_client **const c, const size_t n)
+{
+    bool again;
+
+    do
+    {
+        again = false;
+
+        for (size_t i = 0; i < n; i++)
+        {
+            /* c[i] is set to NULL by the server if closed. */
+            if (!c[i] || !server_client_ready(c[i]))
+                continue;
+            else if (update_client(s, c[i]))
             {
-                if (res < 0)
-                {
-                    fprintf(stderr, "%s: http_update failed\n", __func__);
-                    return -1;
-                }
-                else if (remove_client_from_list(h, cl))
-                {
-                    fprintf(stderr, "%s: remove_client_from_list failed\n",
-                        __func__);
-                    return -1;
-                }
+                fprintf(stderr, "%s: update_client failed\n", __func__);
+                return -1;
             }
-            else
-                server_client_write_pending(cl->c, write);
+
+            again = true;
+        }
+    } while (again);
+
+    return 0;
+}
+
+static int expire_clients(struct shard *const s)
+{
+    struct twheel_timer *t;
+
+    while ((t = twheel_expired(s->timers, s->tick)))
+        if (remove_client_from_list(s, t->user))
+        {
+            fprintf(stderr, "%s: remove_client_from_list failed\n",
+                __func__);
+            return -1;
+        }
+
+    return 0;
+}
+
+static int poll_timeout(struct shard *const s)
+{
+    unsigned long long next = twheel_next(s->timers);
+
+    if (s->deadline && s->deadline < next)
+        next = s->deadline;
+
+    if (next == ULLONG_MAX)
+        return -1;
+    else if (next <= s->tick)
+        return 0;
+    else if (next - s->tick > INT_MAX / TICK_MS)
+        return INT_MAX;
+
+    return (next - s->tick) * TICK_MS;
+}
+
+static int run(struct shard *const s)
+{
+    for (;;)
+    {
+        bool exit;
+        struct server_client **c;
+        size_t n;
+
+        if (get_tick(&s->tick))
+        {
+            fprintf(stderr, "%s: get_tick failed\n", __func__);
+            return -1;
+        }
+        else if (expire_clients(s))
+        {
+            fprintf(stderr, "%s: expire_clients failed\n", __func__);
+            return -1;
+        }
+        else if (s->draining && !server_accepting(s->server)
+            && (!s->clients || (s->deadline && s->tick >= s->deadline)))
+            break;
+        else if (server_poll(s->server, &c, &n, poll_timeout(s), &exit))
+        {
+            fprintf(stderr, "%s: server_poll failed\n", __func__);
+            return -1;
+        }
+        else if (exit)
+            break;
+        else if (get_tick(&s->tick))
+        {
+            fprintf(stderr, "%s: get_tick failed\n", __func__);
+            return -1;
+        }
+        else if (update_clients(s, c, n))
+        {
+            fprintf(stderr, "%s: update_clients failed\n", __func__);
+            return -1;
         }
     }
 
     return 0;
 }
 
-static void free_clients(struct handler *const h)
+static void *run_shard(void *const arg)
 {
-    for (struct client *c = h->clients; c;)
+    struct shard *const s = arg;
+
+    /* Make every other shard exit if one fails. */
+    if ((s->ret = run(s)))
+        server_shutdown();
+
+    return NULL;
+}
+
+static void free_clients(struct shard *const s)
+{
+    for (struct client *c = s->clients; c;)
+    {
+        struct client *const next = c->next;
+
+        server_client_close(s->server, c->c);
+        client_free(c);
+        c = next;
+    }
+
+    for (struct client *c = s->free; c;)
     {
         struct client *const next = c->next;
 
-        server_client_close(h->server, c->c);
         client_free(c);
         c = next;
     }
 }
 
+static int init_done(struct shard *const s)
+{
+    int fds[2];
+
+    /* A socket pair is used instead of a pipe so that the server can
+     * receive from it as from any other client. */
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds))
+    {
+        fprintf(stderr, "%s: socketpair(2): %s\n", __func__, strerror(errno));
+        return -1;
+    }
+
+    s->done_fd = fds[1];
+
+    if (!(s->done = server_client_add(s->server, *fds)))
+    {
+        fprintf(stderr, "%s: server_client_add failed\n", __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* AF_UNIX sockets do not support SO_REUSEPORT, so shards share the
+ * listening socket from the first one instead. */
+static struct server *init_server(const struct shard *const first,
+    const struct server_cfg *const cfg)
+{
+    if (!first || !cfg->path)
+        return server_init(cfg);
+
+    const int fd = dup(server_fd(first->server));
+
+    if (fd < 0)
+    {
+        fprintf(stderr, "%s: dup(2): %s\n", __func__, strerror(errno));
+        return NULL;
+    }
+
+    return server_init_fd(fd);
+}
+
+static void close_fds(const int *const fds, const size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        if (close(fds[i]))
+            fprintf(stderr, "%s: close(2): %s\n", __func__, strerror(errno));
+}
+
+/* Sockets from fds are used first, and then new ones are bound. */
+static int init_shards(struct handler *const h,
+    const struct server_cfg *const cfg, const int *const fds,
+    const size_t n_fds)
+{
+    const size_t req = h->cfg.n_shards ? h->cfg.n_shards : 1,
+        n = n_fds > req ? n_fds : req;
+    struct server_cfg scfg = *cfg;
+
+    if (!(h->shards = calloc(n, sizeof *h->shards)))
+    {
+        fprintf(stderr, "%s: calloc(3): %s\n", __func__, strerror(errno));
+        close_fds(fds, n_fds);
+        return -1;
+    }
+
+    h->n_shards = n;
+    /* The next process might run more shards. */
+    scfg.reuseport = !cfg->path && (n > 1 || h->cfg.handoff);
+
+    for (size_t i = 0; i < n; i++)
+        h->shards[i] = (const struct shard)
+        {
+            .h = h,
+            .done_fd = -1
+        };
+
+    for (size_t i = 0; i < n; i++)
+    {
+        struct shard *const s = &h->shards[i];
+
+        if (i < n_fds)
+        {
+            if (!(s->server = server_init_fd(fds[i])))
+            {
+                fprintf(stderr, "%s: server_init_fd failed\n", __func__);
+                close_fds(&fds[i + 1], n_fds - i - 1);
+                return -1;
+            }
+        }
+        else if (!(s->server = init_server(i ? h->shards : NULL, &scfg)))
+        {
+            fprintf(stderr, "%s: init_server failed\n", __func__);
+            return -1;
+        }
+
+        if (get_tick(&s->tick))
+        {
+            fprintf(stderr, "%s: get_tick failed\n", __func__);
+            return -1;
+        }
+        else if (!(s->timers = twheel_alloc(s->tick)))
+        {
+            fprintf(stderr, "%s: twheel_alloc failed\n", __func__);
+            return -1;
+        }
+        else if (init_done(s))
+        {
+            fprintf(stderr, "%s: init_done failed\n", __func__);
+            return -1;
+        }
+
+        /* All shards must listen to the same port, even if it was
+         * randomly assigned by the system. */
+        scfg.port = server_port(s->server);
+    }
+
+    return 0;
+}
+
+/* Hands the listening sockets over to the first process connecting to
+ * the handoff socket, and then makes every shard drain its clients. */
+static void *run_handoff(void *const arg)
+{
+    struct handler *const h = arg;
+    int fds[HANDOFF_MAX];
+
+    for (size_t i = 0; i < h->n_shards; i++)
+        fds[i] = server_fd(h->shards[i].server);
+
+    const int res = handoff_send(h->handoff_fd, fds, h->n_shards);
+
+    if (res < 0)
+        fprintf(stderr, "%s: handoff_send failed\n", __func__);
+    else if (!res)
+    {
+        printf("Listening sockets handed over, draining connections\n");
+        h->handed_off = true;
+
+        for (size_t i = 0; i < h->n_shards; i++)
+        {
+            const struct client *const c = NULL;
+
+            if (write(h->shards[i].done_fd, &c, sizeof c) != sizeof c)
+                fprintf(stderr, "%s: write(2): %s\n",
+                    __func__, strerror(errno));
+        }
+    }
+
+    return NULL;
+}
+
+static int start_handoff(struct handler *const h)
+{
+    int error;
+
+    if (h->n_shards > HANDOFF_MAX)
+    {
+        fprintf(stderr, "%s: at most %d threads can be handed over\n",
+            __func__, HANDOFF_MAX);
+        return -1;
+    }
+    else if ((h->handoff_fd = handoff_listen(h->cfg.handoff)) < 0)
+    {
+        fprintf(stderr, "%s: handoff_listen failed\n", __func__);
+        return -1;
+    }
+    else if ((error = pthread_create(&h->handoff_thread, NULL, run_handoff,
+        h)))
+    {
+        fprintf(stderr, "%s: pthread_create(3): %s\n",
+            __func__, strerror(error));
+        return -1;
+    }
+
+    h->handoff_started = true;
+    return 0;
+}
+
+static void stop_handoff(struct handler *const h)
+{
+    int error;
+
+    if (h->handoff_started)
+    {
+        /* Makes accept(2) return from run_handoff, if still waiting. */
+        if (shutdown(h->handoff_fd, SHUT_RDWR) && errno != ENOTCONN)
+            fprintf(stderr, "%s: shutdown(2): %s\n",
+                __func__, strerror(errno));
+        else if ((error = pthread_join(h->handoff_thread, NULL)))
+            fprintf(stderr, "%s: pthread_join(3): %s\n",
+                __func__, strerror(error));
+
+        h->handoff_started = false;
+    }
+
+    if (h->handoff_fd >= 0)
+    {
+        if (close(h->handoff_fd))
+            fprintf(stderr, "%s: close(2): %s\n", __func__, strerror(errno));
+        /* Otherwise, the path is now bound by the new process. */
+        else if (!h->handed_off && unlink(h->cfg.handoff))
+            fprintf(stderr, "%s: unlink(2) %s: %s\n",
+                __func__, h->cfg.handoff, strerror(errno));
+
+        h->handoff_fd = -1;
+    }
+}
+
+int handler_listen(struct handler *const h,
+    const struct server_cfg *const cfg)
+{
+    /* Maximum number of queued jobs. Completions must always fit into
+     * the socket buffer, so that workers never block on it. */
+    enum {MAX_JOBS = 256};
+    int ret = -1, fds[HANDOFF_MAX];
+    size_t started = 0, n_fds = 0;
+    const size_t n_workers = h->cfg.n_workers;
+    const char *const handoff = h->cfg.handoff;
+
+    if (n_workers && !(h->wpool = wpool_alloc(n_workers, MAX_JOBS)))
+    {
+        fprintf(stderr, "%s: wpool_alloc failed\n", __func__);
+        return -1;
+    }
+    else if (handoff && handoff_recv(handoff, fds, &n_fds))
+    {
+        fprintf(stderr, "%s: handoff_recv failed\n", __func__);
+        return -1;
+    }
+    else if (n_fds)
+        printf("Received %zu listening sockets from %s\n", n_fds, handoff);
+
+    if (init_shards(h, cfg, fds, n_fds))
+    {
+        fprintf(stderr, "%s: init_shards failed\n", __func__);
+        return -1;
+    }
+    else if (handoff && start_handoff(h))
+    {
+        fprintf(stderr, "%s: start_handoff failed\n", __func__);
+        return -1;
+    }
+
+    /* The first shard runs on the calling thread. */
+    for (size_t i = 1; i < h->n_shards; i++, started++)
+    {
+        struct shard *const s = &h->shards[i];
+        const int error = pthread_create(&s->thread, NULL, run_shard, s);
+
+        if (error)
+        {
+            fprintf(stderr, "%s: pthread_create(3): %s\n",
+                __func__, strerror(error));
+            server_shutdown();
+            goto end;
+        }
+    }
+
+    run_shard(&h->shards[0]);
+
+    if (h->shards[0].ret)
+        goto end;
+
+    ret = 0;
+
+end:
+    for (size_t i = 1; i <= started; i++)
+    {
+        struct shard *const s = &h->shards[i];
+        const int error = pthread_join(s->thread, NULL);
+
+        if (error)
+        {
+            fprintf(stderr, "%s: pthread_join(3): %s\n",
+                __func__, strerror(error));
+            ret = -1;
+        }
+        else if (s->ret)
+            ret = -1;
+    }
+
+    printf("Exiting...\n");
+    return ret;
+}
+
 void handler_free(struct handler *const h)
 {
     if (h)
@@ -258,9 +1185,31 @@ void handler_free(struct handler *const h)
         for (size_t i = 0; i < h->n_cfg; i++)
             free(h->elem[i].url);
 
+        /* run_handoff refers to shards. */
+        stop_handoff(h);
+        /* Workers might still refer to clients. */
+        wpool_free(h->wpool);
+
+        for (size_t i = 0; i < h->n_shards; i++)
+        {
+            struct shard *const s = &h->shards[i];
+
+            free_clients(s);
+
+            if (s->done)
+                server_client_close(s->server, s->done);
+
+            if (s->done_fd >= 0 && close(s->done_fd))
+                fprintf(stderr, "%s: close(2): %s\n",
+                    __func__, strerror(errno));
+
+            server_close(s->server);
+            twheel_free(s->timers);
+        }
+
+        pthread_mutex_destroy(&h->mutex);
         free(h->elem);
-        free_clients(h);
-        server_close(h->server);
+        free(h->shards);
     }
 
     free(h);
@@ -268,6 +1217,7 @@ void handler_free(struct handler *const h)
 
 struct handler *handler_alloc(const struct handler_cfg *const cfg)
 {
+    int error;
     struct handler *const h = malloc(sizeof *h);
 
     if (!h)
@@ -277,12 +1227,26 @@ struct handler *handler_alloc(const struct handler_cfg *const cfg)
         return NULL;
     }
 
-    *h = (const struct handler){.cfg = *cfg};
+    *h = (const struct handler)
+    {
+        .cfg = *cfg,
+        .handoff_fd = -1
+    };
+
+    if ((error = pthread_mutex_init(&h->mutex, NULL)))
+    {
+        fprintf(stderr, "%s: pthread_mutex_init(3): %s\n",
+            __func__, strerror(error));
+        free(h);
+        return NULL;
+    }
+
     return h;
 }
 
-int handler_add(struct handler *const h, const char *url,
-    const enum http_op op, const handler_fn f, void *const user)
+static int add(struct handler *const h, const char *const url,
+    const enum http_op op, const handler_fn f, const handler_async_fn af,
+    void *const user)
 {
     const size_t n = h->n_cfg + 1;
     struct elem *const elem = realloc(h->elem, n * sizeof *h->elem);
@@ -300,6 +1264,7 @@ int handler_add(struct handler *const h, const char *url,
         .url = strdup(url),
         .op = op,
         .f = f,
+        .af = af,
         .user = user
     };
 
@@ -313,3 +1278,15 @@ int handler_add(struct handler *const h, const char *url,
     h->n_cfg = n;
     return 0;
 }
+
+int handler_add(struct handler *const h, const char *const url,
+    const enum http_op op, const handler_fn f, void *const user)
+{
+    return add(h, url, op, f, NULL, user);
+}
+
+int handler_add_async(struct handler *const h, const char *const url,
+    const enum http_op op, const handler_async_fn f, void *const user)
+{
+    return add(h, url, op, NULL, f, user);
+}
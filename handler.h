@@ -2,14 +2,72 @@
 #define HANDLER_H
 
 #include "http.h"
+#include "server.h"
+#include <limits.h>
 #include <stddef.h>
 
+/* Handlers might block, so they are run by worker threads, if available. */
 typedef int (*handler_fn)(const struct http_payload *p,
     struct http_response *r, void *user);
 
+struct handler_token;
+
+/* Asynchronous handlers run on the event loop, so they must not block.
+ * Instead, they can return HANDLER_PENDING and then fill r and call
+ * handler_complete with token later on, from any thread. Meanwhile, p and
+ * r remain valid and the connection is not polled. */
+typedef int (*handler_async_fn)(const struct http_payload *p,
+    struct http_response *r, struct handler_token *token, void *user);
+
+enum {HANDLER_PENDING = INT_MIN};
+
 struct handler_cfg
 {
     const char *tmpdir;
+    /* Optional path to an AF_UNIX socket. On startup, listening sockets
+     * are received from any process listening to it. Then, they are handed
+     * over to the next process connecting to it, and connections are
+     * drained. */
+    const char *handoff;
+    /* Number of event loops, each running on its own thread. Zero is
+     * equivalent to one. */
+    size_t n_shards;
+    /* Number of worker threads running handlers and the length callback,
+     * so that blocking operations do not stall event loops. Zero runs
+     * them on the event loops. */
+    size_t n_workers;
+    /* Connection timeouts, in seconds. Zero disables them. */
+    struct handler_timeouts
+    {
+        /* Time allowed to receive the request line and headers. */
+        unsigned long header;
+        /* Time allowed between received chunks from the request body. */
+        unsigned long body;
+        /* Time allowed for the response to make any progress. */
+        unsigned long write;
+        /* Time allowed for idle connections to send a new request. */
+        unsigned long idle;
+        /* Time allowed for existing connections to finish once the
+         * listening sockets are handed over to another process. */
+        unsigned long drain;
+    } timeouts;
+
+    /* Admission control, shared among every shard. Zero means no limit. */
+    struct handler_limits
+    {
+        /* Concurrent connections. Excess ones are closed right after
+         * sending them a 503 response. */
+        unsigned long clients;
+        /* Concurrent uploads, and the sum of their lengths in bytes.
+         * Excess uploads are rejected before reading their body. */
+        unsigned long uploads, upload_bytes;
+        /* Length of bodies other than uploads, which are kept in memory.
+         * Longer ones are rejected with a 413 response. */
+        unsigned long form_bytes;
+        /* Requests served per connection, after which it is closed. */
+        unsigned long requests;
+    } limits;
+
     int (*length)(unsigned long long len, const struct http_cookie *c,
         struct http_response *r, void *user);
     void *user;
@@ -19,6 +77,10 @@ struct handler *handler_alloc(const struct handler_cfg *cfg);
 void handler_free(struct handler *h);
 int handler_add(struct handler *h, const char *url, enum http_op op,
     handler_fn f, void *user);
-int handler_listen(struct handler *h, short port);
+int handler_add_async(struct handler *h, const char *url, enum http_op op,
+    handler_async_fn f, void *user);
+/* ret has the same meaning as the value returned by handler_fn. */
+void handler_complete(struct handler_token *token, int ret);
+int handler_listen(struct handler *h, const struct server_cfg *cfg);
 
 #endif /* HANDLER_H */
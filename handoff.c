@@ -0,0 +1,269 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "handoff.h"
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+union control
+{
+    char buf[CMSG_SPACE(HANDOFF_MAX * sizeof (int))];
+    struct cmsghdr align;
+};
+
+static int get_addr(const char *const path, struct sockaddr_un *const a)
+{
+    if (strlen(path) >= sizeof a->sun_path)
+    {
+        fprintf(stderr, "%s: path too long: %s\n", __func__, path);
+        return -1;
+    }
+
+    *a = (const struct sockaddr_un){.sun_family = AF_UNIX};
+    strcpy(a->sun_path, path);
+    return 0;
+}
+
+static int get_fds(const struct msghdr *const m, int *const fds,
+    size_t *const n)
+{
+    const struct cmsghdr *const c = CMSG_FIRSTHDR(m);
+
+    if (m->msg_flags & MSG_CTRUNC)
+    {
+        fprintf(stderr, "%s: truncated control data\n", __func__);
+        return -1;
+    }
+    else if (!c || c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS)
+    {
+        fprintf(stderr, "%s: expected SCM_RIGHTS\n", __func__);
+        return -1;
+    }
+
+    *n = (c->cmsg_len - CMSG_LEN(0)) / sizeof *fds;
+    memcpy(fds, CMSG_DATA(c), *n * sizeof *fds);
+    return 0;
+}
+
+int handoff_recv(const char *const path, int *const fds, size_t *const n)
+{
+    int ret = -1;
+    struct sockaddr_un a;
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    char b;
+    union control u;
+    struct iovec iov =
+    {
+        .iov_base = &b,
+        .iov_len = sizeof b
+    };
+
+    struct msghdr m =
+    {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = u.buf,
+        .msg_controllen = sizeof u.buf
+    };
+
+    *n = 0;
+
+    if (fd < 0)
+    {
+        fprintf(stderr, "%s: socket(2): %s\n", __func__, strerror(errno));
+        return -1;
+    }
+    else if (get_addr(path, &a))
+    {
+        fprintf(stderr, "%s: get_addr failed\n", __func__);
+        goto end;
+    }
+    else if (connect(fd, (const struct sockaddr *)&a, sizeof a))
+    {
+        /* No process is listening. */
+        if (errno == ENOENT || errno == ECONNREFUSED)
+            ret = 0;
+        else
+            fprintf(stderr, "%s: connect(2) %s: %s\n",
+                __func__, path, strerror(errno));
+
+        goto end;
+    }
+
+    ssize_t r;
+
+    while ((r = recvmsg(fd, &m, 0)) < 0 && errno == EINTR)
+        ;
+
+    if (r < 0)
+    {
+        fprintf(stderr, "%s: recvmsg(2): %s\n", __func__, strerror(errno));
+        goto end;
+    }
+    else if (!r)
+    {
+        fprintf(stderr, "%s: unexpected end of file\n", __func__);
+        goto end;
+    }
+    else if (get_fds(&m, fds, n))
+    {
+        fprintf(stderr, "%s: get_fds failed\n", __func__);
+        goto end;
+    }
+
+    ret = 0;
+
+end:
+    if (close(fd))
+    {
+        fprintf(stderr, "%s: close(2): %s\n", __func__, strerror(errno));
+        ret = -1;
+    }
+
+    return ret;
+}
+
+int handoff_send(const int fd, const int *const fds, const size_t n)
+{
+    int ret = -1, cfd;
+    char b = 0;
+    union control u;
+    struct iovec iov =
+    {
+        .iov_base = &b,
+        .iov_len = sizeof b
+    };
+
+    const size_t len = n * sizeof *fds;
+    struct msghdr m =
+    {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = u.buf,
+        .msg_controllen = CMSG_SPACE(len)
+    };
+
+    if (n > HANDOFF_MAX)
+    {
+        fprintf(stderr, "%s: too many file descriptors: %zu\n", __func__, n);
+        return -1;
+    }
+
+    while ((cfd = accept(fd, NULL, NULL)) < 0 && errno == EINTR)
+        ;
+
+    if (cfd < 0)
+    {
+        /* accept(2) fails with EINVAL once fd is shut down. */
+        if (errno == EINVAL)
+            return 1;
+
+        fprintf(stderr, "%s: accept(2): %s\n", __func__, strerror(errno));
+        return -1;
+    }
+
+    struct cmsghdr *const c = CMSG_FIRSTHDR(&m);
+
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(len);
+    memcpy(CMSG_DATA(c), fds, len);
+
+    ssize_t r;
+
+    while ((r = sendmsg(cfd, &m, 0)) < 0 && errno == EINTR)
+        ;
+
+    if (r < 0)
+    {
+        fprintf(stderr, "%s: sendmsg(2): %s\n", __func__, strerror(errno));
+        goto end;
+    }
+
+    ret = 0;
+
+end:
+    if (close(cfd))
+    {
+        fprintf(stderr, "%s: close(2): %s\n", __func__, strerror(errno));
+        ret = -1;
+    }
+
+    return ret;
+}
+
+int handoff_listen(const char *const path)
+{
+    struct sockaddr_un a;
+    struct stat sb;
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd < 0)
+    {
+        fprintf(stderr, "%s: socket(2): %s\n", __func__, strerror(errno));
+        return -1;
+    }
+    else if (get_addr(path, &a))
+    {
+        fprintf(stderr, "%s: get_addr failed\n", __func__);
+        goto failure;
+    }
+    else if (!stat(path, &sb))
+    {
+        if (!S_ISSOCK(sb.st_mode))
+        {
+            fprintf(stderr, "%s: %s exists and is not a socket\n",
+                __func__, path);
+            goto failure;
+        }
+        /* Either left behind or bound by the process that handed its
+         * sockets over, which no longer needs it. */
+        else if (unlink(path))
+        {
+            fprintf(stderr, "%s: unlink(2) %s: %s\n",
+                __func__, path, strerror(errno));
+            goto failure;
+        }
+    }
+    else if (errno != ENOENT)
+    {
+        fprintf(stderr, "%s: stat(2) %s: %s\n",
+            __func__, path, strerror(errno));
+        goto failure;
+    }
+
+    if (bind(fd, (const struct sockaddr *)&a, sizeof a))
+    {
+        fprintf(stderr, "%s: bind(2) %s: %s\n",
+            __func__, path, strerror(errno));
+        goto failure;
+    }
+    /* Connections are not possible until listen(2) is called. */
+    else if (chmod(path, S_IRUSR | S_IWUSR))
+    {
+        fprintf(stderr, "%s: chmod(2) %s: %s\n",
+            __func__, path, strerror(errno));
+        goto failure;
+    }
+    else if (listen(fd, 1))
+    {
+        fprintf(stderr, "%s: listen(2): %s\n", __func__, strerror(errno));
+        goto failure;
+    }
+
+    return fd;
+
+failure:
+
+    if (close(fd))
+        fprintf(stderr, "%s: close(2): %s\n", __func__, strerror(errno));
+
+    return -1;
+}
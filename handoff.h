@@ -0,0 +1,22 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stddef.h>
+
+/* Listening sockets are handed over from a running process to a new one
+ * through an AF_UNIX socket, so that restarts never stop accepting
+ * connections. */
+enum {HANDOFF_MAX = 64};
+
+/* Receives up to HANDOFF_MAX listening sockets into fds from the process
+ * listening to path. *n is set to zero if no process is listening. */
+int handoff_recv(const char *path, int *fds, size_t *n);
+/* Binds a socket to path, replacing any previous one, so that a new
+ * process can connect to it. Only the current user can connect. */
+int handoff_listen(const char *path);
+/* Waits for a new process to connect to fd and sends fds to it. Returns
+ * zero on success, a negative value on error or a positive value if fd
+ * was shut down while waiting. */
+int handoff_send(int fd, const int *fds, size_t n);
+
+#endif /* HANDOFF_H */
@@ -7,6 +7,7 @@
 #include <ctype.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdlib.h>
@@ -14,9 +15,65 @@
 #include <string.h>
 #include <strings.h>
 #include <time.h>
+#include <zlib.h>
 
 #define HTTP_VERSION "HTTP/1.1"
 
+enum
+{
+    /* Smaller bodies are sent uncompressed, as the savings would not be
+     * worth the cost. */
+    GZIP_MIN = 1024,
+    GZIP_CHUNK = 8192,
+    /* deflate(3) needs (1 << (GZIP_WBITS + 2)) + (1 << (GZIP_MEMLEVEL + 9))
+     * bytes per response, so 64 KiB rather than the default 256 KiB, at
+     * a small cost in compression ratio. */
+    GZIP_WBITS = 13,
+    GZIP_MEMLEVEL = 6,
+    CHUNK_HEAD = sizeof "ffff\r\n" - 1,
+    ARENA_BLOCK = 4096,
+    /* Bytes from the request head copied into the request arena, so
+     * that repeated headers cannot grow it indefinitely. */
+    HEAD_MAX = 16384,
+    /* Bodies other than uploads are kept in memory, so they are bounded
+     * even if http_cfg.form_bytes is zero. */
+    FORM_MAX = 1 << 20
+};
+
+/* Bodies are compressed while they are sent, so that only the output for
+ * one chunk is kept in memory. */
+struct gzip
+{
+    z_stream z;
+    bool end;
+    size_t pos, len;
+    char buf[CHUNK_HEAD + GZIP_CHUNK + sizeof "\r\n0\r\n\r\n" - 1];
+};
+
+/* Strictest alignment needed by objects allocated from an arena. */
+union align
+{
+    long double ld;
+    long long ll;
+    void *p;
+    void (*f)(void);
+};
+
+/* Objects needed for a single request or response are allocated from an
+ * arena, so that they are released at once rather than one by one. */
+struct arena
+{
+    struct block
+    {
+        struct block *next;
+        size_t len, size;
+        union align buf[];
+    } *blocks;
+
+    /* Last allocation, which can be grown in place. */
+    void *last;
+};
+
 struct http_ctx
 {
     struct ctx
@@ -35,8 +92,15 @@ struct http_ctx
         } lstate;
 
         enum http_op op;
-        char *resource, *field, *value, *boundary;
-        size_t len;
+        /* close is set if the connection must be closed after the
+         * response. */
+        bool head, close;
+        /* Allocated from arena. */
+        const char *resource, *field, *value, *boundary, *range, *if_range,
+            *if_none_match, *if_modified_since, *accept_encoding;
+        /* len is the length of h->line, and stored the number of bytes
+         * copied by store. */
+        size_t len, stored;
 
         struct post
         {
@@ -44,6 +108,26 @@ struct http_ctx
             unsigned long long len, read;
         } post;
 
+        /* Non-multipart bodies are decoded as
+         * application/x-www-form-urlencoded while they are received.
+         * Keys and values are stored one after another into buf as
+         * null-terminated strings. */
+        struct urlform
+        {
+            enum
+            {
+                UF_KEY,
+                UF_VALUE
+            } state;
+
+            /* Hexadecimal digits left from a percent-encoded byte. */
+            unsigned pct;
+            unsigned char hex;
+            char *buf;
+            size_t len, key, value, n;
+            struct http_post_form *forms;
+        } uf;
+
         union
         {
             struct start_line
@@ -74,7 +158,6 @@ struct http_ctx
                 } bstate;
 
                 off_t len, written;
-                char *boundary;
                 const char *dir;
                 size_t blen, nforms, nfiles;
                 int fd;
@@ -89,31 +172,226 @@ struct http_ctx
 
         struct http_arg *args;
         size_t n_args;
+        struct arena arena;
     } ctx;
 
     struct write_ctx
     {
-        bool pending, close;
+        bool pending, close, copy, head, chunked;
         enum state state;
         struct http_response r;
-        off_t n;
-        struct dynstr d;
+        /* Only set if the body is sent compressed, where n counts the
+         * bytes from the body consumed by the compressor. */
+        struct gzip *gz;
+        /* off is the file offset for the next byte from the body to be
+         * sent. */
+        off_t n, off;
+        char len[sizeof "18446744073709551615"];
+
+        /* Byte ranges from the file body selected by the Range header,
+         * each preceded by a header if sent as multipart/byteranges. n
+         * counts the bytes sent from the current part, including its
+         * header. */
+        struct part
+        {
+            struct dynstr head;
+            off_t off;
+            unsigned long long len;
+        } *parts;
+
+        size_t n_parts, part;
+        /* Response headers and byte ranges, as well as any memory from
+         * http_response_alloc. */
+        struct arena arena;
     } wctx;
 
     /* From RFC9112, section 3 (Request line):
      * It is RECOMMENDED that all HTTP senders and recipients support,
      * at a minimum, request-line lengths of 8000 octets. */
     char line[8000];
+
+    /* Received data not processed yet, so that requests are read in
+     * chunks rather than one byte at a time. Data beyond the headers is
+     * consumed by the body or the next request. */
+    struct rbuf
+    {
+        char buf[4096];
+        size_t pos, len;
+    } rb;
+
     struct http_cfg cfg;
+
+    /* Callbacks might suspend h until http_resume is called, so their
+     * arguments are stored here to remain valid meanwhile. */
+    struct http_payload payload;
+    int (*resume)(struct http_ctx *, int);
+    bool suspended;
+    /* Requests received from the current connection. */
+    unsigned long requests;
 };
 
-static void arg_free(struct http_arg *const a)
+static size_t arena_round(const size_t n)
+{
+    return (n + sizeof (union align) - 1) / sizeof (union align)
+        * sizeof (union align);
+}
+
+static void *arena_alloc(struct arena *const a, const size_t n)
+{
+    if (n > SIZE_MAX - sizeof (union align))
+    {
+        fprintf(stderr, "%s: size too large: %zu\n", __func__, n);
+        return NULL;
+    }
+
+    const size_t rn = arena_round(n);
+    struct block *b = a->blocks;
+
+    if (!b || b->size - b->len < rn)
+    {
+        const size_t size = rn > ARENA_BLOCK ? rn : ARENA_BLOCK;
+
+        if (!(b = malloc(sizeof *b + size)))
+        {
+            fprintf(stderr, "%s: malloc(3): %s\n", __func__, strerror(errno));
+            return NULL;
+        }
+
+        *b = (const struct block)
+        {
+            .next = a->blocks,
+            .size = size
+        };
+
+        a->blocks = b;
+    }
+
+    void *const ret = (char *)b->buf + b->len;
+
+    b->len += rn;
+    a->last = ret;
+    return ret;
+}
+
+/* Same semantics as realloc(3), given the current size of p. */
+static void *arena_realloc(struct arena *const a, void *const p,
+    const size_t old, const size_t n)
+{
+    struct block *const b = a->blocks;
+
+    if (p && p == a->last && n <= SIZE_MAX - sizeof (union align))
+    {
+        const size_t off = (char *)p - (char *)b->buf, rn = arena_round(n);
+
+        if (b->size - off >= rn)
+        {
+            b->len = off + rn;
+            return p;
+        }
+    }
+
+    void *const ret = arena_alloc(a, n);
+
+    if (ret && p)
+        memcpy(ret, p, old < n ? old : n);
+
+    return ret;
+}
+
+static char *arena_strndup(struct arena *const a, const char *const s,
+    const size_t n)
+{
+    char *const ret = arena_alloc(a, n + 1);
+
+    if (ret)
+    {
+        memcpy(ret, s, n);
+        ret[n] = '\0';
+    }
+
+    return ret;
+}
+
+/* Blocks are released, except for one of the default size, so that most
+ * requests and responses need no allocations at all. */
+static void arena_reset(struct arena *const a)
+{
+    struct block *keep = NULL;
+
+    for (struct block *b = a->blocks, *next; b; b = next)
+    {
+        next = b->next;
+
+        if (!keep && b->size == ARENA_BLOCK)
+        {
+            keep = b;
+            keep->next = NULL;
+            keep->len = 0;
+        }
+        else
+            free(b);
+    }
+
+    *a = (const struct arena)
+    {
+        .blocks = keep
+    };
+}
+
+static void arena_free(struct arena *const a)
+{
+    for (struct block *b = a->blocks, *next; b; b = next)
+    {
+        next = b->next;
+        free(b);
+    }
+
+    *a = (const struct arena){0};
+}
+
+/* Request line fields and header values are needed after their line is
+ * overwritten, so they are copied into the request arena as
+ * null-terminated strings. */
+static char *store(struct http_ctx *const h, const char *const s,
+    const size_t n)
 {
-    if (a)
+    struct ctx *const c = &h->ctx;
+
+    if (n >= HEAD_MAX - c->stored)
+    {
+        fprintf(stderr, "%s: request head too large\n", __func__);
+        return NULL;
+    }
+
+    char *const ret = arena_strndup(&c->arena, s, n);
+
+    if (!ret)
     {
-        free(a->key);
-        free(a->value);
+        fprintf(stderr, "%s: arena_strndup failed\n", __func__);
+        return NULL;
     }
+
+    c->stored += n + 1;
+    return ret;
+}
+
+static int hexdigit(const char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    else if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    else if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+
+    return -1;
+}
+
+/* Unlike strncmp(3), prefixes of token do not compare equal. */
+static bool match(const char *const s, const size_t n,
+    const char *const token)
+{
+    return strlen(token) == n && !strncmp(s, token, n);
 }
 
 static size_t chrcnt(const char *s, const int c)
@@ -126,91 +404,72 @@ static size_t chrcnt(const char *s, const int c)
     return ret;
 }
 
-static int parse_arg(struct ctx *const c, const char *const arg,
-    const size_t n)
+/* arg is split and decoded in place, including its terminating '&', if
+ * any. */
+static int parse_arg(struct ctx *const c, char *const arg, const size_t n)
 {
-    int ret = -1;
-    struct http_arg a = {0}, *args = NULL;
-    const char *sep = memchr(arg, '=', n);
-    char *enckey = NULL, *encvalue = NULL;
+    char *const sep = memchr(arg, '=', n);
 
     if (!sep)
     {
         fprintf(stderr, "%s: expected '='\n", __func__);
-        ret = 1;
-        goto end;
+        return 1;
     }
     else if (sep == arg)
     {
         fprintf(stderr, "%s: expected key\n", __func__);
-        ret = 1;
-        goto end;
+        return 1;
     }
 
-    const char *const value = sep + 1;
+    char *const value = sep + 1;
 
     if (!*value)
     {
         fprintf(stderr, "%s: missing value: %.*s\n", __func__, (int)n, arg);
-        ret = 1;
-        goto end;
+        return 1;
     }
 
-    const size_t keylen = sep - arg, valuelen = n - keylen - 1;
-
-    if (!(enckey = strndup(arg, keylen)))
-    {
-        fprintf(stderr, "%s: strndup(3) key: %s\n", __func__, strerror(errno));
-        goto end;
-    }
-    else if (!(encvalue = strndup(value, valuelen)))
-    {
-        fprintf(stderr, "%s: strndup(3) value: %s\n",
-            __func__, strerror(errno));
-        goto end;
-    }
+    *sep = '\0';
+    arg[n] = '\0';
 
     /* URL parameters use '+' for whitespace, rather than %20. */
-    a = (const struct http_arg)
-    {
-        .key = http_decode_url(enckey, true),
-        .value = http_decode_url(encvalue, true)
-    };
-
-    if (!a.key)
+    if (http_decode_url(arg, true))
     {
         fprintf(stderr, "%s: http_decode_url key failed\n", __func__);
-        goto end;
+        return 1;
     }
-    else if (!a.value)
+    else if (http_decode_url(value, true))
     {
         fprintf(stderr, "%s: http_decode_url value failed\n", __func__);
-        goto end;
+        return 1;
     }
-    else if (!(args = realloc(c->args, (c->n_args + 1) * sizeof *args)))
+
+    const size_t n_args = c->n_args + 1;
+    struct http_arg *const args = arena_realloc(&c->arena, c->args,
+        c->n_args * sizeof *c->args, n_args * sizeof *c->args);
+
+    if (!args)
     {
-        fprintf(stderr, "%s: realloc(3): %s\n", __func__, strerror(errno));
-        goto end;
+        fprintf(stderr, "%s: arena_realloc failed\n", __func__);
+        return -1;
     }
 
-    args[c->n_args++] = a;
-    c->args = args;
-    ret = 0;
-
-end:
-    if (ret)
-        arg_free(&a);
+    args[c->n_args] = (const struct http_arg)
+    {
+        .key = arg,
+        .value = value
+    };
 
-    free(enckey);
-    free(encvalue);
-    return ret;
+    c->args = args;
+    c->n_args = n_args;
+    return 0;
 }
 
-static int parse_first_arg(struct ctx *const c, const char *const arg,
+static int parse_first_arg(struct ctx *const c, char *const arg,
     const char *const ad_arg, const char *const res)
 {
     int error;
-    const char *const next = arg + 1;
+    char *const next = arg + 1;
 
     if (chrcnt(next, '?'))
     {
@@ -235,10 +494,10 @@ static int parse_first_arg(struct ctx *const c, const char *const arg,
     return 0;
 }
 
-static int parse_adargs(struct ctx *const c, const char *const start,
+static int parse_adargs(struct ctx *const c, char *const start,
     const char *const res)
 {
-    for (const char *arg = start, *next; arg; arg = next)
+    for (char *arg = start, *next; arg; arg = next)
     {
         next = strchr(++arg, '&');
 
@@ -255,20 +514,17 @@ static int parse_adargs(struct ctx *const c, const char *const start,
     return 0;
 }
 
-static int parse_args(struct ctx *const c, const char *const res,
-    size_t *const reslen)
+/* Arguments are split from res in place, so that res is left with the
+ * resource only. */
+static int parse_args(struct ctx *const c, char *const res)
 {
     int error;
-    const char *const arg_start = strchr(res, '?'),
-        *const ad_arg = strchr(res, '&');
+    char *const arg_start = strchr(res, '?'), *const ad_arg = strchr(res, '&');
 
     if (!arg_start)
     {
         if (!ad_arg)
-        {
-            *reslen = strlen(res);
             return 0;
-        }
         else
         {
             fprintf(stderr, "%s: expected argument indicator '?': %s\n",
@@ -297,39 +553,55 @@ static int parse_args(struct ctx *const c, const char *const res,
         return error;
     }
 
-    *reslen = arg_start - res;
+    *arg_start = '\0';
     return 0;
 }
 
-static int parse_resource(struct ctx *const c, const char *const enc_res)
+static int parse_resource(struct ctx *const c, char *const res)
 {
-    int ret = -1, error;
-    size_t reslen;
-    char *trimmed_encres = NULL, *resource = NULL;
+    int error;
 
-    if ((error = parse_args(c, enc_res, &reslen)))
+    if ((error = parse_args(c, res)))
     {
         fprintf(stderr, "%s: parse_args failed\n", __func__);
-        ret = error;
-        goto end;
+        return error;
     }
-    else if (!(trimmed_encres = strndup(enc_res, reslen)))
+    else if (http_decode_url(res, false))
     {
-        fprintf(stderr, "%s: strndup(3): %s\n", __func__, strerror(errno));
-        goto end;
+        fprintf(stderr, "%s: http_decode_url failed\n", __func__);
+        return 1;
     }
-    else if (!(resource = http_decode_url(trimmed_encres, false)))
+
+    c->resource = res;
+    return 0;
+}
+
+static int start_response(struct http_ctx *const h)
+{
+    struct write_ctx *const w = &h->wctx;
+    const int n = snprintf(w->len, sizeof w->len, "%llu", w->r.n);
+
+    if (n < 0 || n >= sizeof w->len)
     {
-        fprintf(stderr, "%s: http_decode_url failed\n", __func__);
-        goto end;
+        fprintf(stderr, "%s: snprintf(3) failed\n", __func__);
+        return -1;
     }
 
-    c->resource = resource;
-    ret = 0;
+    w->pending = true;
+    return 0;
+}
+
+/* Responds to a request that cannot be processed further, such as a
+ * malformed one, so the connection is closed afterwards. */
+static int reject(struct http_ctx *const h, const enum http_status status)
+{
+    h->wctx.r = (const struct http_response)
+    {
+        .status = status
+    };
 
-end:
-    free(trimmed_encres);
-    return ret;
+    h->wctx.close = true;
+    return start_response(h);
 }
 
 static int start_line(struct http_ctx *const h)
@@ -353,9 +625,15 @@ static int start_line(struct http_ctx *const h)
     struct ctx *const c = &h->ctx;
     const size_t n = op - line;
 
-    if (!strncmp(line, "GET", n))
+    if (match(line, n, "GET"))
+        c->op = HTTP_OP_GET;
+    /* Served as GET, except for the response body. */
+    else if (match(line, n, "HEAD"))
+    {
         c->op = HTTP_OP_GET;
-    else if (!strncmp(line, "POST", n))
+        c->head = true;
+    }
+    else if (match(line, n, "POST"))
         c->op = HTTP_OP_POST;
     else
     {
@@ -396,34 +674,32 @@ static int start_line(struct http_ctx *const h)
         return 1;
     }
 
-    int ret = 1, error;
-    char *enc_res = NULL;
+    int error;
+    char *res;
 
     if (strcmp(protocol, HTTP_VERSION))
     {
         fprintf(stderr, "%s: unsupported protocol %s\n", __func__, protocol);
-        goto end;
+        return 1;
     }
-    else if (!(enc_res = strndup(resource, res_n)))
+    else if (!(res = store(h, resource, res_n)))
     {
-        fprintf(stderr, "%s: strndup(3): %s\n", __func__, strerror(errno));
-        ret = -1;
-        goto end;
+        fprintf(stderr, "%s: store failed\n", __func__);
+        return reject(h, HTTP_STATUS_URI_TOO_LONG);
     }
-    else if ((error = parse_resource(c, enc_res)))
+    else if ((error = parse_resource(c, res)))
     {
         fprintf(stderr, "%s: parse_resource failed\n", __func__);
-        ret = error;
-        goto end;
+        return error < 0 ? reject(h, HTTP_STATUS_SERVICE_UNAVAILABLE) : error;
     }
 
     printf("%.*s %s %s\n", (int)n, line, c->resource, protocol);
-    ret = 0;
-    c->state = HEADER_CR_LINE;
 
-end:
-    free(enc_res);
-    return ret;
+    if (h->cfg.max_requests && ++h->requests >= h->cfg.max_requests)
+        c->close = true;
+
+    c->state = HEADER_CR_LINE;
+    return 0;
 }
 
 static void ctx_free(struct ctx *const c)
@@ -432,20 +708,13 @@ static void ctx_free(struct ctx *const c)
     {
         struct multiform *const m = &c->u.mf;
 
-        free(m->files);
-        free(m->boundary);
-
         if (m->fd >= 0 && close(m->fd))
             fprintf(stderr, "%s: close(2) m->fd: %s\n",
                 __func__, strerror(errno));
 
         for (size_t i = 0; i < m->nforms; i++)
         {
-            struct form *const f = &m->forms[i];
-
-            free(f->name);
-            free(f->filename);
-            free(f->value);
+            const struct form *const f = &m->forms[i];
 
             if (f->tmpname && remove(f->tmpname) && errno != ENOENT)
                 fprintf(stderr, "%s: remove(3) %s: %s\n",
@@ -453,41 +722,44 @@ static void ctx_free(struct ctx *const c)
 
             free(f->tmpname);
         }
-
-        free(m->forms);
     }
 
-    free(c->field);
-    free(c->value);
-    free(c->resource);
-    free(c->boundary);
+    struct arena a = c->arena;
 
-    for (size_t i = 0; i < c->n_args; i++)
-        arg_free(&c->args[i]);
-
-    free(c->args);
-    *c = (const struct ctx){0};
+    arena_reset(&a);
+    *c = (const struct ctx)
+    {
+        .arena = a
+    };
 }
 
-static int prepare_headers(struct http_ctx *const h)
+/* Reads from buffered data, if any. Otherwise, small reads are buffered,
+ * so that subsequent ones require no system calls, whereas larger ones
+ * are read directly into buf. */
+static int http_recv(struct http_ctx *const h, void *const buf,
+    const size_t n)
 {
-    struct write_ctx *const w = &h->wctx;
-    struct dynstr *const d = &w->d;
-
-    dynstr_init(d);
+    struct rbuf *const rb = &h->rb;
 
-    for (size_t i = 0; i < w->r.n_headers; i++)
+    if (rb->pos >= rb->len)
     {
-        const struct http_header *const hdr = &w->r.headers[i];
+        if (n >= sizeof rb->buf)
+            return h->cfg.read(buf, n, h->cfg.user);
+
+        const int r = h->cfg.read(rb->buf, sizeof rb->buf, h->cfg.user);
+
+        if (r <= 0)
+            return r;
 
-        dynstr_append_or_ret_nonzero(d, "%s: %s\r\n", hdr->header, hdr->value);
-        free(hdr->header);
-        free(hdr->value);
+        rb->pos = 0;
+        rb->len = r;
     }
 
-    free(w->r.headers);
-    dynstr_append_or_ret_nonzero(d, "\r\n");
-    return 0;
+    const size_t avail = rb->len - rb->pos, rem = n > avail ? avail : n;
+
+    memcpy(buf, rb->buf + rb->pos, rem);
+    rb->pos += rem;
+    return rem;
 }
 
 static int rw_error(const int r, bool *const close)
@@ -522,43 +794,30 @@ static int rw_error(const int r, bool *const close)
     return -1;
 }
 
-static int write_start_line(struct http_ctx *const h, bool *const close)
+/* Header names used by responses are not copied. */
+static const char *const names[] =
 {
-    struct write_ctx *const w = &h->wctx;
-    struct dynstr *const d = &w->d;
-    const size_t rem = d->len - w->n;
-    const int res = h->cfg.write(d->str + w->n, rem, h->cfg.user);
-
-    if (res <= 0)
-        return rw_error(res, close);
-    else if ((w->n += res) >= d->len)
-    {
-        char len[sizeof "18446744073709551615"];
-        const int res = snprintf(len, sizeof len, "%llu", w->r.n);
-
-        dynstr_free(d);
-
-        if (res < 0 || res >= sizeof len)
-        {
-            fprintf(stderr, "%s: snprintf(3) failed\n", __func__);
-            return -1;
-        }
-        else if (http_response_add_header(&w->r, "Content-Length", len))
-        {
-            fprintf(stderr, "%s: http_response_add_header failed\n", __func__);
-            return -1;
-        }
-        else if (prepare_headers(h))
-        {
-            fprintf(stderr, "%s: prepare_headers failed\n", __func__);
-            return -1;
-        }
+    "Accept-Ranges",
+    "Cache-Control",
+    "Content-Disposition",
+    "Content-Encoding",
+    "Content-Range",
+    "Content-Type",
+    "ETag",
+    "Last-Modified",
+    "Location",
+    "Retry-After",
+    "Set-Cookie",
+    "Vary"
+};
 
-        w->state = HEADER_CR_LINE;
-        w->n = 0;
-    }
+static const char *intern(const char *const header)
+{
+    for (size_t i = 0; i < sizeof names / sizeof *names; i++)
+        if (!strcmp(header, names[i]))
+            return names[i];
 
-    return 0;
+    return NULL;
 }
 
 static int write_ctx_free(struct write_ctx *const w)
@@ -572,103 +831,317 @@ static int write_ctx_free(struct write_ctx *const w)
     if (r->f && (ret = fclose(r->f)))
         fprintf(stderr, "%s: fclose(3): %s\n", __func__, strerror(errno));
 
-    dynstr_free(&w->d);
-    *w = (const struct write_ctx){0};
+    if (w->gz)
+    {
+        deflateEnd(&w->gz->z);
+        free(w->gz);
+    }
+
+    for (size_t i = 0; i < w->n_parts; i++)
+        dynstr_free(&w->parts[i].head);
+
+    struct arena a = w->arena;
+
+    arena_reset(&a);
+    *w = (const struct write_ctx)
+    {
+        .arena = a
+    };
+
     return ret;
 }
 
-static int write_header_cr_line(struct http_ctx *const h, bool *const close)
+static int end_body(struct http_ctx *const h, bool *const close)
 {
     struct write_ctx *const w = &h->wctx;
-    struct dynstr *const d = &w->d;
-    const size_t rem = d->len - w->n;
-    const int res = h->cfg.write(d->str + w->n, rem, h->cfg.user);
+    const bool close_pending = w->close;
 
-    if (res <= 0)
-        return rw_error(res, close);
-    else if ((w->n += res) >= d->len)
+    if (write_ctx_free(w))
     {
-        const bool close_pending = w->close;
-
-        dynstr_free(d);
-
-        if (w->r.n)
-        {
-            w->state = BODY_LINE;
-            w->n = 0;
-        }
-        else if (write_ctx_free(w))
-        {
-            fprintf(stderr, "%s: write_ctx_free failed\n", __func__);
-            return -1;
-        }
-        else if (close_pending)
-            *close = true;
+        fprintf(stderr, "%s: write_ctx_free failed\n", __func__);
+        return -1;
     }
+    else if (close_pending)
+        *close = true;
 
     return 0;
 }
 
-static int write_body_mem(struct http_ctx *const h, bool *const close)
+/* Data to be sent with a single call to writev(2). Bytes already sent are
+ * skipped, so that the same data can be gathered again after a partial
+ * write. len is the total length, whether it fits into iov or not. */
+struct gather
 {
-    struct write_ctx *const w = &h->wctx;
-    const struct http_response *const r = &w->r;
-    const size_t rem = r->n - w->n;
-    const int res = h->cfg.write((const char *)r->buf.ro + w->n, rem,
-        h->cfg.user);
+    struct iovec iov[64];
+    int n;
+    unsigned long long skip, len;
+};
 
-    if (res <= 0)
-        return rw_error(res, close);
-    else if ((w->n += res) >= r->n)
+static void gather(struct gather *const g, const void *const buf,
+    const size_t n)
+{
+    if (g->skip >= n)
+        g->skip -= n;
+    else if (g->n < sizeof g->iov / sizeof *g->iov)
     {
-        const bool close_pending = w->close;
-
-        if (write_ctx_free(w))
+        g->iov[g->n++] = (const struct iovec)
         {
-            fprintf(stderr, "%s: write_ctx_free failed\n", __func__);
-            return -1;
-        }
-        else if (close_pending)
-            *close = true;
+            .iov_base = (char *)buf + g->skip,
+            .iov_len = n - g->skip
+        };
 
-        return res;
+        g->skip = 0;
     }
 
-    return 0;
+    g->len += n;
 }
 
-static int write_body_file(struct http_ctx *const h, bool *const close)
+/* Sends the status line and headers, along with the body if kept in
+ * memory. */
+static int write_head(struct http_ctx *const h, bool *const close)
 {
+#define LINE(code, descr) HTTP_VERSION " " #code " " descr "\r\n"
+    static const struct status_line
+    {
+        const char *s;
+        size_t n;
+    } lines[] =
+    {
+#define X(x, y, z) [HTTP_STATUS_##x] = \
+    { \
+        .s = LINE(z, y), \
+        .n = sizeof LINE(z, y) - 1 \
+    },
+        HTTP_STATUSES
+#undef X
+    };
+#undef LINE
+
     struct write_ctx *const w = &h->wctx;
     const struct http_response *const r = &w->r;
-    const unsigned long long left = r->n - w->n;
-    char buf[1024];
-    const size_t rem = left > sizeof buf ? sizeof buf : left;
+    const struct status_line *const l = &lines[r->status];
+    const bool body = r->buf.ro && !w->gz && !w->head;
+    struct gather g = {.skip = w->n};
 
-    if (!fread(buf, 1, rem, r->f))
+    gather(&g, l->s, l->n);
+
+    for (size_t i = 0; i < r->n_headers; i++)
     {
-        fprintf(stderr, "%s: fread(3) failed, ferror=%d, feof=%d\n",
-            __func__, ferror(r->f), feof(r->f));
-        return -1;
+        const struct http_header *const hdr = &r->headers[i];
+
+        gather(&g, hdr->header, strlen(hdr->header));
+        gather(&g, ": ", strlen(": "));
+        gather(&g, hdr->value, strlen(hdr->value));
+        gather(&g, "\r\n", strlen("\r\n"));
+    }
+
+    if (w->chunked)
+        gather(&g, "Transfer-Encoding: chunked\r\n",
+            strlen("Transfer-Encoding: chunked\r\n"));
+    /* Neither 304 nor 1xx responses have content, so their length is not
+     * known. */
+    else if (r->status != HTTP_STATUS_NOT_MODIFIED
+        && r->status != HTTP_STATUS_CONTINUE)
+    {
+        gather(&g, "Content-Length: ", strlen("Content-Length: "));
+        gather(&g, w->len, strlen(w->len));
+        gather(&g, "\r\n", strlen("\r\n"));
     }
 
-    const int res = h->cfg.write(buf, rem, h->cfg.user);
+    /* Required by RFC 9112, section 9.6, so that clients do not send
+     * further requests. */
+    if (w->close)
+        gather(&g, "Connection: close\r\n", strlen("Connection: close\r\n"));
+
+    gather(&g, "\r\n", strlen("\r\n"));
+
+    if (body)
+        gather(&g, r->buf.ro, r->n);
+
+    const int res = h->cfg.writev(g.iov, g.n, h->cfg.user);
 
     if (res <= 0)
         return rw_error(res, close);
-    else if ((w->n += res) >= r->n)
+    else if ((w->n += res) < g.len)
+        return 0;
+    else if (body || !r->n || w->head)
+        return end_body(h, close);
+    else if (w->parts)
+        w->off = w->parts->off;
+    else if (r->f && (w->off = ftello(r->f)) < 0)
+    {
+        fprintf(stderr, "%s: ftello(3): %s\n", __func__, strerror(errno));
+        return -1;
+    }
+
+    w->state = BODY_LINE;
+    w->n = 0;
+    return 0;
+}
+
+/* Sends up to n bytes from the file body, starting at w->off. */
+static int send_file(struct http_ctx *const h, const unsigned long long n)
+{
+    struct write_ctx *const w = &h->wctx;
+    const int fd = fileno(w->r.f);
+
+    if (!w->copy && h->cfg.sendfile)
+    {
+        const size_t rem = n > SIZE_MAX ? SIZE_MAX : n;
+        const int res = h->cfg.sendfile(fd, &w->off, rem, h->cfg.user);
+
+        /* Not supported by the system or by this kind of file. */
+        if (res >= 0 || (errno != ENOSYS && errno != EINVAL))
+            return res;
+
+        w->copy = true;
+    }
+
+    char buf[BUFSIZ];
+    const size_t rem = n > sizeof buf ? sizeof buf : n;
+    const ssize_t r = pread(fd, buf, rem, w->off);
+
+    if (r < 0)
+    {
+        fprintf(stderr, "%s: pread(2): %s\n", __func__, strerror(errno));
+        return -1;
+    }
+    else if (!r)
+    {
+        fprintf(stderr, "%s: unexpected end of file\n", __func__);
+        return -1;
+    }
+
+    const int res = h->cfg.write(buf, r, h->cfg.user);
+
+    if (res > 0)
+        w->off += res;
+
+    return res;
+}
+
+static int write_parts(struct http_ctx *const h, bool *const close)
+{
+    struct write_ctx *const w = &h->wctx;
+    const struct part *const p = &w->parts[w->part];
+    const struct dynstr *const d = &p->head;
+    const int res = w->n < d->len ?
+        h->cfg.write(d->str + w->n, d->len - w->n, h->cfg.user)
+        : send_file(h, p->len - (w->n - d->len));
+
+    if (res <= 0)
+        return rw_error(res, close);
+    else if ((w->n += res) >= d->len + p->len)
+    {
+        if (++w->part >= w->n_parts)
+            return end_body(h, close);
+
+        w->n = 0;
+        w->off = w->parts[w->part].off;
+    }
+
+    return 0;
+}
+
+static int write_body_file(struct http_ctx *const h, bool *const close)
+{
+    struct write_ctx *const w = &h->wctx;
+    const struct http_response *const r = &w->r;
+
+    if (w->parts)
+        return write_parts(h, close);
+
+    const int res = send_file(h, r->n - w->n);
+
+    if (res <= 0)
+        return rw_error(res, close);
+    else if ((w->n += res) >= r->n)
+        return end_body(h, close);
+
+    return 0;
+}
+
+/* Compresses the next chunk from the body into g->buf, preceded by its
+ * size and followed by the last chunk once the body is complete. */
+static int deflate_chunk(struct write_ctx *const w)
+{
+    struct gzip *const g = w->gz;
+    z_stream *const z = &g->z;
+    const struct http_response *const r = &w->r;
+    int ret;
+
+    z->next_out = (Bytef *)g->buf + CHUNK_HEAD;
+    z->avail_out = GZIP_CHUNK;
+
+    do
+    {
+        const unsigned long long rem = r->n - w->n;
+        const uInt n = rem > UINT_MAX ? UINT_MAX : rem;
+
+        z->next_in = (Bytef *)r->buf.ro + w->n;
+        z->avail_in = n;
+        ret = deflate(z, rem > UINT_MAX ? Z_NO_FLUSH : Z_FINISH);
+        w->n += n - z->avail_in;
+    } while (ret == Z_OK && z->avail_out);
+
+    if (ret != Z_OK && ret != Z_STREAM_END)
+    {
+        fprintf(stderr, "%s: deflate failed: %s\n", __func__,
+            z->msg ? z->msg : "unknown error");
+        return -1;
+    }
+
+    const size_t n = GZIP_CHUNK - z->avail_out;
+
+    g->pos = g->len = CHUNK_HEAD;
+
+    if (n)
     {
-        const bool close_pending = w->close;
+        char head[CHUNK_HEAD + 1];
+        const int hn = snprintf(head, sizeof head, "%zx\r\n", n);
 
-        if (write_ctx_free(w))
+        if (hn < 0 || hn >= sizeof head)
         {
-            fprintf(stderr, "%s: write_ctx_free failed\n", __func__);
+            fprintf(stderr, "%s: snprintf(3) failed\n", __func__);
             return -1;
         }
-        else if (close_pending)
-            *close = true;
+
+        g->pos -= hn;
+        memcpy(g->buf + g->pos, head, hn);
+        g->len += n;
+        memcpy(g->buf + g->len, "\r\n", strlen("\r\n"));
+        g->len += strlen("\r\n");
+    }
+
+    if (ret == Z_STREAM_END)
+    {
+        memcpy(g->buf + g->len, "0\r\n\r\n", strlen("0\r\n\r\n"));
+        g->len += strlen("0\r\n\r\n");
+        g->end = true;
+    }
+
+    return 0;
+}
+
+static int write_body_gzip(struct http_ctx *const h, bool *const close)
+{
+    struct write_ctx *const w = &h->wctx;
+    struct gzip *const g = w->gz;
+
+    if (g->pos >= g->len && deflate_chunk(w))
+    {
+        fprintf(stderr, "%s: deflate_chunk failed\n", __func__);
+        return -1;
     }
 
+    const int res = h->cfg.write(g->buf + g->pos, g->len - g->pos,
+        h->cfg.user);
+
+    if (res <= 0)
+        return rw_error(res, close);
+    else if ((g->pos += res) >= g->len && g->end)
+        return end_body(h, close);
+
     return 0;
 }
 
@@ -676,12 +1149,12 @@ static int write_body_line(struct http_ctx *const h, bool *const close)
 {
     const struct http_response *const r = &h->wctx.r;
 
-    if (r->buf.ro)
-        return write_body_mem(h, close);
+    if (h->wctx.gz)
+        return write_body_gzip(h, close);
     else if (r->f)
         return write_body_file(h, close);
 
-    fprintf(stderr, "%s: expected either buffer or file path\n", __func__);
+    fprintf(stderr, "%s: expected either compressor or file\n", __func__);
     return -1;
 }
 
@@ -689,9 +1162,8 @@ static int http_write(struct http_ctx *const h, bool *const close)
 {
     static int (*const fn[])(struct http_ctx *, bool *) =
     {
-        [START_LINE] = write_start_line,
-        [HEADER_CR_LINE] = write_header_cr_line,
-        [BODY_LINE] = write_body_line,
+        [START_LINE] = write_head,
+        [BODY_LINE] = write_body_line
     };
 
     struct write_ctx *const w = &h->wctx;
@@ -704,97 +1176,145 @@ static int http_write(struct http_ctx *const h, bool *const close)
     return ret;
 }
 
+/* Responses are only given to callbacks from their write_ctx. */
+static struct write_ctx *response_ctx(struct http_response *const r)
+{
+    return (struct write_ctx *)((char *)r - offsetof(struct write_ctx, r));
+}
+
+void *http_response_alloc(struct http_response *const r, const size_t n)
+{
+    return arena_alloc(&response_ctx(r)->arena, n);
+}
+
 int http_response_add_header(struct http_response *const r,
     const char *const header, const char *const value)
 {
+    struct arena *const a = &response_ctx(r)->arena;
     const size_t n = r->n_headers + 1;
-    struct http_header *const headers = realloc(r->headers,
-        n * sizeof *r->headers), *h = NULL;
+    struct http_header *const headers = arena_realloc(a, r->headers,
+        r->n_headers * sizeof *r->headers, n * sizeof *r->headers);
 
     if (!headers)
     {
-        fprintf(stderr, "%s: realloc(3): %s\n", __func__, strerror(errno));
+        fprintf(stderr, "%s: arena_realloc failed\n", __func__);
         return -1;
     }
 
-    h = &headers[r->n_headers];
+    /* Set before any other allocation, so that it is not lost. */
+    r->headers = headers;
+
+    const char *const name = intern(header);
+    struct http_header *const h = &headers[r->n_headers];
 
     *h = (const struct http_header)
     {
-        .header = strdup(header),
-        .value = strdup(value)
+        .header = name ? name : arena_strndup(a, header, strlen(header)),
+        .value = arena_strndup(a, value, strlen(value))
     };
 
     if (!h->header || !h->value)
     {
-        fprintf(stderr, "%s: strdup(3): %s\n", __func__, strerror(errno));
-        free(h->header);
-        free(h->value);
+        fprintf(stderr, "%s: arena_strndup failed\n", __func__);
         return -1;
     }
 
-    r->headers = headers;
     r->n_headers = n;
     return 0;
 }
 
-static int start_response(struct http_ctx *const h)
-{
-    static const struct code
-    {
-        const char *descr;
-        int code;
-    } codes[] =
-    {
-#define X(x, y, z) [HTTP_STATUS_##x] = {.descr = y, .code = z},
-        HTTP_STATUSES
-#undef X
-    };
-
-    struct write_ctx *const w = &h->wctx;
-    const struct code *const c = &codes[w->r.status];
-
-    w->pending = true;
-    dynstr_init(&w->d);
-    dynstr_append_or_ret_nonzero(&w->d, HTTP_VERSION " %d %s\r\n",
-        c->code, c->descr);
-    return 0;
-}
-
 static int set_cookie(struct http_ctx *const h, const char *const cookie)
 {
     struct ctx *const c = &h->ctx;
     const char *const value = strchr(cookie, '=');
+    char *field;
 
     if (!value)
     {
         fprintf(stderr, "%s: expected field=value for cookie %s\n",
             __func__, cookie);
-        goto failure;
+        return -1;
     }
     else if (!*(value + 1))
     {
         fprintf(stderr, "%s: expected non-empty value for cookie %s\n",
             __func__, cookie);
-        goto failure;
+        return -1;
     }
-    else if (!(c->field = strndup(cookie, value - cookie)))
+    else if (!(field = store(h, cookie, strlen(cookie))))
     {
-        fprintf(stderr, "%s: malloc(3) field: %s\n", __func__, strerror(errno));
-        goto failure;
+        fprintf(stderr, "%s: store failed\n", __func__);
+        return reject(h, HTTP_STATUS_REQUEST_HEADER_FIELDS_TOO_LARGE);
     }
-    else if (!(c->value = strdup(value + 1)))
+
+    const size_t n = value - cookie;
+
+    field[n] = '\0';
+    c->field = field;
+    c->value = field + n + 1;
+    return 0;
+}
+
+static int store_header(struct http_ctx *const h, const char **const dst,
+    const char *const value)
+{
+    const char *const v = store(h, value, strlen(value));
+
+    if (!v)
     {
-        fprintf(stderr, "%s: malloc(3) value: %s\n", __func__, strerror(errno));
-        goto failure;
+        fprintf(stderr, "%s: store failed\n", __func__);
+        return reject(h, HTTP_STATUS_REQUEST_HEADER_FIELDS_TOO_LARGE);
     }
 
+    *dst = v;
     return 0;
+}
 
-failure:
-    free(c->field);
-    free(c->value);
-    return -1;
+static int set_range(struct http_ctx *const h, const char *const range)
+{
+    return store_header(h, &h->ctx.range, range);
+}
+
+static int set_if_range(struct http_ctx *const h, const char *const value)
+{
+    return store_header(h, &h->ctx.if_range, value);
+}
+
+static int set_if_none_match(struct http_ctx *const h,
+    const char *const value)
+{
+    return store_header(h, &h->ctx.if_none_match, value);
+}
+
+static int set_if_modified_since(struct http_ctx *const h,
+    const char *const value)
+{
+    return store_header(h, &h->ctx.if_modified_since, value);
+}
+
+static int set_accept_encoding(struct http_ctx *const h,
+    const char *const value)
+{
+    return store_header(h, &h->ctx.accept_encoding, value);
+}
+
+/* Connections are persistent by default in HTTP/1.1, so only the close
+ * option needs to be looked for. */
+static int set_connection(struct http_ctx *const h, const char *value)
+{
+    static const char delim[] = ", \t";
+
+    while (*(value += strspn(value, delim)))
+    {
+        const size_t n = strcspn(value, delim);
+
+        if (n == strlen("close") && !strncasecmp(value, "close", n))
+            h->ctx.close = true;
+
+        value += n;
+    }
+
+    return 0;
 }
 
 static int set_length(struct http_ctx *const h, const char *const len)
@@ -869,23 +1389,95 @@ static int set_content_type(struct http_ctx *const h, const char *const type)
         fprintf(stderr, "%s: expected value after boundary\n", __func__);
         return 1;
     }
+    /* Not allowed by RFC 2046, and needed by read_mf_body_boundary. */
+    else if (strchr(val, '\r'))
+    {
+        fprintf(stderr, "%s: invalid boundary %s\n", __func__, val);
+        return 1;
+    }
 
     struct ctx *const c = &h->ctx;
-    struct dynstr b;
-
-    dynstr_init(&b);
+    static const char prefix[] = "\r\n--";
+    const size_t len = strlen(prefix) + strlen(val);
+    char *const b = arena_alloc(&c->arena, len + 1);
 
-    if (dynstr_append(&b, "\r\n--%s", val))
+    if (!b)
     {
-        fprintf(stderr, "%s: dynstr_append failed\n", __func__);
+        fprintf(stderr, "%s: arena_alloc failed\n", __func__);
         return -1;
     }
 
-    c->boundary = b.str;
+    strcpy(b, prefix);
+    strcat(b, val);
+    c->boundary = b;
     c->u.mf = (const struct multiform){.fd = -1};
     return 0;
 }
 
+static bool zero_weight(const char *q)
+{
+    if (*q++ != '0')
+        return false;
+    else if (*q == '.')
+        q += 1 + strspn(q + 1, "0");
+
+    return !isdigit((unsigned char)*q);
+}
+
+/* Looks up coding from an Accept-Encoding list, as defined by RFC 9110,
+ * section 12.5.3. */
+static bool accepts_coding(const char *s, const char *const coding)
+{
+    const size_t len = strlen(coding);
+    bool any = false;
+
+    while (*s)
+    {
+        s += strspn(s, " \t,");
+
+        const char *const c = s;
+        const size_t n = strcspn(s, " \t;,");
+        bool accept = true;
+
+        s += n;
+
+        /* The weight is the only parameter defined for codings. */
+        while (s += strspn(s, " \t"), *s == ';')
+        {
+            s++;
+            s += strspn(s, " \t");
+
+            if (!strncasecmp(s, "q=", strlen("q=")))
+                accept = !zero_weight(s + strlen("q="));
+
+            s += strcspn(s, ";,");
+        }
+
+        if (n == len && !strncasecmp(c, coding, n))
+            return accept;
+        else if (n == strlen("*") && *c == '*')
+            any = accept;
+    }
+
+    return any;
+}
+
+static unsigned encodings(const char *const accept)
+{
+    unsigned ret = 0;
+
+    if (accept)
+    {
+        if (accepts_coding(accept, "gzip"))
+            ret |= HTTP_ENCODING_GZIP;
+
+        if (accepts_coding(accept, "zstd"))
+            ret |= HTTP_ENCODING_ZSTD;
+    }
+
+    return ret;
+}
+
 static struct http_payload ctx_to_payload(const struct ctx *const c)
 {
     return (const struct http_payload)
@@ -898,32 +1490,573 @@ static struct http_payload ctx_to_payload(const struct ctx *const c)
 
         .op = c->op,
         .resource = c->resource,
+        .encodings = encodings(c->accept_encoding),
         .args = c->args,
         .n_args = c->n_args
     };
 }
 
-static int payload_get(struct http_ctx *const h, const char *const line)
+static int call_payload(struct http_ctx *const h,
+    const struct http_payload *const p,
+    int (*const resume)(struct http_ctx *, int))
 {
-    struct ctx *const c = &h->ctx;
-    const struct http_payload p = ctx_to_payload(c);
-    const int ret = h->cfg.payload(&p, &h->wctx.r, h->cfg.user);
+    h->payload = *p;
+    h->resume = resume;
 
-    ctx_free(c);
+    const int ret = h->cfg.payload(&h->payload, &h->wctx.r, h->cfg.user);
 
-    if (ret)
-        return ret;
+    return h->suspended ? 0 : resume(h, ret);
+}
 
-    return start_response(h);
+/* Multiple ranges cost one part header each, so they are limited to
+ * prevent abuse. Requests with more ranges are served as a whole. */
+enum {MAX_RANGES = 16};
+
+struct range
+{
+    unsigned long long start, len;
+};
+
+static bool parse_pos(const char **const s, unsigned long long *const pos)
+{
+    const char *p = *s;
+
+    if (!isdigit((unsigned char)*p))
+        return false;
+
+    for (*pos = 0; isdigit((unsigned char)*p); p++)
+    {
+        const unsigned d = *p - '0';
+
+        if (*pos > (ULLONG_MAX - d) / 10)
+            return false;
+
+        *pos = *pos * 10 + d;
+    }
+
+    *s = p;
+    return true;
 }
 
-static int payload_post(struct http_ctx *const h, const char *const line)
+/* Parses a byte range set, as defined by RFC 9110, section 14.1.2, into
+ * the ranges satisfiable for a representation of size bytes. Returns
+ * non-zero if the header must be ignored. */
+static int parse_ranges(const char *s, const unsigned long long size,
+    struct range *const ranges, size_t *const n)
 {
-    struct ctx *const c = &h->ctx;
-    const struct http_payload pl = ctx_to_payload(c);
-    const int ret = h->cfg.payload(&pl, &h->wctx.r, h->cfg.user);
+    static const char unit[] = "bytes=";
+    size_t specs = 0;
 
-    ctx_free(c);
+    *n = 0;
+
+    if (strncasecmp(s, unit, strlen(unit)))
+        return 1;
+
+    for (s += strlen(unit); *s;)
+    {
+        unsigned long long first, last = ULLONG_MAX;
+
+        while (*s == ' ' || *s == '\t')
+            s++;
+
+        if (*s == ',')
+        {
+            s++;
+            continue;
+        }
+        else if (++specs > MAX_RANGES)
+            return 1;
+        else if (*s == '-')
+        {
+            unsigned long long suffix;
+
+            s++;
+
+            if (!parse_pos(&s, &suffix))
+                return 1;
+            else if (suffix)
+                ranges[(*n)++] = (const struct range)
+                {
+                    .start = suffix < size ? size - suffix : 0,
+                    .len = suffix < size ? suffix : size
+                };
+        }
+        else if (!parse_pos(&s, &first) || *s++ != '-')
+            return 1;
+        else if (isdigit((unsigned char)*s)
+            && (!parse_pos(&s, &last) || last < first))
+            return 1;
+        else if (first < size)
+            ranges[(*n)++] = (const struct range)
+            {
+                .start = first,
+                .len = (last < size ? last + 1 : size) - first
+            };
+
+        while (*s == ' ' || *s == '\t')
+            s++;
+
+        if (*s && *s++ != ',')
+            return 1;
+    }
+
+    return specs ? 0 : 1;
+}
+
+static struct http_header *find_header(const struct http_response *const r,
+    const char *const header)
+{
+    for (size_t i = 0; i < r->n_headers; i++)
+    {
+        struct http_header *const h = &r->headers[i];
+
+        if (!strcasecmp(h->header, header))
+            return h;
+    }
+
+    return NULL;
+}
+
+static long long days_from_civil(int y, const unsigned m, const unsigned d)
+{
+    y -= m <= 2;
+
+    const long long era = (y >= 0 ? y : y - 399) / 400;
+    const unsigned yoe = y - era * 400,
+        doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1,
+        doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+    return era * 146097 + doe - 719468;
+}
+
+/* Parses any of the formats from RFC 9110, section 5.6.7. */
+static int parse_date(const char *const s, time_t *const t)
+{
+    static const char *const months[] =
+    {
+        "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+        "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+    };
+
+    char month[sizeof "Jan"];
+    int day, year, hour, min, sec;
+
+    if (sscanf(s, "%*3s, %2d %3s %4d %2d:%2d:%2d GMT",
+            &day, month, &year, &hour, &min, &sec) == 6)
+        ;
+    else if (sscanf(s, "%*[A-Za-z], %2d-%3s-%2d %2d:%2d:%2d GMT",
+            &day, month, &year, &hour, &min, &sec) == 6)
+        year += year < 70 ? 2000 : 1900;
+    else if (sscanf(s, "%*3s %3s %2d %2d:%2d:%2d %4d",
+            month, &day, &hour, &min, &sec, &year) != 6)
+        return -1;
+
+    for (size_t i = 0; i < sizeof months / sizeof *months; i++)
+        if (!strcmp(month, months[i]))
+        {
+            if (day < 1 || day > 31 || hour > 23 || min > 59 || sec > 60)
+                return -1;
+
+            *t = days_from_civil(year, i + 1, day) * 86400
+                + hour * 3600 + min * 60 + sec;
+            return 0;
+        }
+
+    return -1;
+}
+
+/* Ranges are ignored if the representation has changed since the client
+ * got its validator, as defined by RFC 9110, section 13.1.5. */
+static bool if_range(const char *const v, const struct http_response *const r)
+{
+    if (!v)
+        return true;
+    /* Entity tags are compared with the strong comparison function, so
+     * weak ones never match. */
+    else if (*v == '"')
+    {
+        const struct http_header *const h = find_header(r, "ETag");
+
+        return h && !strcmp(v, h->value);
+    }
+    /* Encoded representations, such as precompressed sidecars, share
+     * Last-Modified with their source file, so a date cannot tell which
+     * one the client holds. */
+    else if (find_header(r, "Content-Encoding"))
+        return false;
+
+    const struct http_header *const h = find_header(r, "Last-Modified");
+    const time_t now = time(NULL);
+    time_t lm;
+
+    /* Dates have a resolution of one second, so Last-Modified is only
+     * a strong validator if it is at least one second older than the
+     * response, as defined by RFC 9110, section 8.8.2.2. */
+    return h && !strcmp(v, h->value) && now != (time_t)-1
+        && !parse_date(h->value, &lm) && now - lm >= 1;
+}
+
+static int unsatisfiable(struct http_response *const r,
+    const unsigned long long size)
+{
+    char range[sizeof "bytes */18446744073709551615"];
+    const int n = snprintf(range, sizeof range, "bytes */%llu", size);
+
+    if (n < 0 || n >= sizeof range)
+    {
+        fprintf(stderr, "%s: snprintf(3) failed\n", __func__);
+        return -1;
+    }
+    else if (fclose(r->f))
+    {
+        fprintf(stderr, "%s: fclose(3): %s\n", __func__, strerror(errno));
+        return -1;
+    }
+
+    r->status = HTTP_STATUS_RANGE_NOT_SATISFIABLE;
+    r->f = NULL;
+    r->n = 0;
+
+    if (http_response_add_header(r, "Content-Range", range))
+    {
+        fprintf(stderr, "%s: http_response_add_header failed\n", __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int single_range(struct write_ctx *const w, const off_t base,
+    const struct range *const rg)
+{
+    struct http_response *const r = &w->r;
+    struct dynstr d;
+
+    dynstr_init(&d);
+
+    if (dynstr_append(&d, "bytes %llu-%llu/%llu",
+        rg->start, rg->start + rg->len - 1, r->n))
+    {
+        fprintf(stderr, "%s: dynstr_append failed\n", __func__);
+        return -1;
+    }
+    else if (http_response_add_header(r, "Content-Range", d.str))
+    {
+        fprintf(stderr, "%s: http_response_add_header failed\n", __func__);
+        dynstr_free(&d);
+        return -1;
+    }
+    else if (!(w->parts = arena_alloc(&w->arena, sizeof *w->parts)))
+    {
+        fprintf(stderr, "%s: arena_alloc failed\n", __func__);
+        dynstr_free(&d);
+        return -1;
+    }
+
+    dynstr_free(&d);
+    *w->parts = (const struct part)
+    {
+        .off = base + rg->start,
+        .len = rg->len
+    };
+
+    w->n_parts = 1;
+    r->status = HTTP_STATUS_PARTIAL_CONTENT;
+    r->n = rg->len;
+    return 0;
+}
+
+static int multiple_ranges(struct write_ctx *const w, const off_t base,
+    const struct range *const ranges, const size_t n)
+{
+    struct http_response *const r = &w->r;
+    struct http_header *const type = find_header(r, "Content-Type");
+    char boundary[sizeof "ffffffffffffffff-ffffffffffffffff"];
+    /* One part per range, followed by the closing delimiter. */
+    const size_t n_parts = n + 1;
+    unsigned long long len = 0;
+    /* Unique among concurrent responses. */
+    int res = snprintf(boundary, sizeof boundary, "%llx-%jx",
+        (unsigned long long)time(NULL), (uintmax_t)(uintptr_t)w);
+
+    if (res < 0 || res >= sizeof boundary)
+    {
+        fprintf(stderr, "%s: snprintf(3) failed\n", __func__);
+        return -1;
+    }
+    else if (!(w->parts = arena_alloc(&w->arena,
+        n_parts * sizeof *w->parts)))
+    {
+        fprintf(stderr, "%s: arena_alloc failed\n", __func__);
+        return -1;
+    }
+
+    memset(w->parts, 0, n_parts * sizeof *w->parts);
+    w->n_parts = n_parts;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        const struct range *const rg = &ranges[i];
+        struct part *const p = &w->parts[i];
+        struct dynstr *const d = &p->head;
+
+        dynstr_init(d);
+
+        if (dynstr_append(d, "\r\n--%s\r\n", boundary)
+            || (type && dynstr_append(d, "Content-Type: %s\r\n", type->value))
+            || dynstr_append(d, "Content-Range: bytes %llu-%llu/%llu\r\n\r\n",
+                rg->start, rg->start + rg->len - 1, r->n))
+        {
+            fprintf(stderr, "%s: dynstr_append failed\n", __func__);
+            return -1;
+        }
+
+        p->off = base + rg->start;
+        p->len = rg->len;
+        len += d->len + p->len;
+    }
+
+    struct dynstr *const end = &w->parts[n].head;
+
+    dynstr_init(end);
+
+    if (dynstr_append(end, "\r\n--%s--\r\n", boundary))
+    {
+        fprintf(stderr, "%s: dynstr_append failed\n", __func__);
+        return -1;
+    }
+
+    char t[sizeof "multipart/byteranges; boundary=" + sizeof boundary];
+
+    res = snprintf(t, sizeof t, "multipart/byteranges; boundary=%s", boundary);
+
+    if (res < 0 || res >= sizeof t)
+    {
+        fprintf(stderr, "%s: snprintf(3) failed\n", __func__);
+        return -1;
+    }
+    else if (type)
+    {
+        if (!(type->value = arena_strndup(&w->arena, t, res)))
+        {
+            fprintf(stderr, "%s: arena_strndup failed\n", __func__);
+            return -1;
+        }
+    }
+    else if (http_response_add_header(r, "Content-Type", t))
+    {
+        fprintf(stderr, "%s: http_response_add_header failed\n", __func__);
+        return -1;
+    }
+
+    r->status = HTTP_STATUS_PARTIAL_CONTENT;
+    r->n = len + end->len;
+    return 0;
+}
+
+/* Complete file bodies are advertised to support byte ranges, which are
+ * then served according to the Range and If-Range headers. */
+static int prepare_ranges(struct http_ctx *const h)
+{
+    const struct ctx *const c = &h->ctx;
+    struct write_ctx *const w = &h->wctx;
+    struct http_response *const r = &w->r;
+
+    if (c->op != HTTP_OP_GET || r->status != HTTP_STATUS_OK || !r->f)
+        return 0;
+    else if (http_response_add_header(r, "Accept-Ranges", "bytes"))
+    {
+        fprintf(stderr, "%s: http_response_add_header failed\n", __func__);
+        return -1;
+    }
+    /* Byte ranges only apply to GET, as defined by RFC 9110,
+     * section 14.2. */
+    else if (c->head || !c->range || !if_range(c->if_range, r))
+        return 0;
+
+    struct range ranges[MAX_RANGES];
+    size_t n;
+    const off_t base = ftello(r->f);
+
+    if (base < 0)
+    {
+        fprintf(stderr, "%s: ftello(3): %s\n", __func__, strerror(errno));
+        return -1;
+    }
+    else if (parse_ranges(c->range, r->n, ranges, &n))
+        return 0;
+    else if (!n)
+        return unsatisfiable(r, r->n);
+    else if (n == 1)
+        return single_range(w, base, ranges);
+
+    return multiple_ranges(w, base, ranges, n);
+}
+
+/* Entity tags are compared with the weak comparison function, as required
+ * by RFC 9110, section 13.1.2. */
+static bool etag_match(const char *list, const char *const etag)
+{
+    const char *const tag = strncmp(etag, "W/", strlen("W/")) ?
+        etag : etag + strlen("W/");
+    const size_t n = strlen(tag);
+
+    for (;;)
+    {
+        list += strspn(list, " \t,");
+
+        if (*list == '*')
+            return true;
+        else if (!strncmp(list, "W/", strlen("W/")))
+            list += strlen("W/");
+
+        const char *const end = *list == '"' ? strchr(list + 1, '"') : NULL;
+
+        if (!end)
+            return false;
+
+        const size_t len = end + 1 - list;
+
+        if (len == n && !strncmp(list, tag, n))
+            return true;
+
+        list = end + 1;
+    }
+}
+
+/* Evaluated as defined by RFC 9110, section 13.2.2, where If-None-Match
+ * takes precedence over If-Modified-Since. */
+static bool not_modified(const struct ctx *const c,
+    const struct http_response *const r)
+{
+    if (c->if_none_match)
+    {
+        const struct http_header *const h = find_header(r, "ETag");
+
+        return etag_match(c->if_none_match, h ? h->value : "");
+    }
+    else if (c->if_modified_since)
+    {
+        const struct http_header *const h = find_header(r, "Last-Modified");
+        time_t ims, lm;
+
+        return h && !parse_date(c->if_modified_since, &ims)
+            && !parse_date(h->value, &lm) && lm <= ims;
+    }
+
+    return false;
+}
+
+static int set_not_modified(struct http_response *const r)
+{
+    FILE *const f = r->f;
+
+    if (r->free)
+        r->free(r->buf.rw);
+
+    r->status = HTTP_STATUS_NOT_MODIFIED;
+    r->buf.ro = NULL;
+    r->free = NULL;
+    r->f = NULL;
+    r->n = 0;
+
+    if (f && fclose(f))
+    {
+        fprintf(stderr, "%s: fclose(3): %s\n", __func__, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Text bodies generated in memory, such as directory listings, are
+ * compressed if the client supports it. */
+static int prepare_gzip(struct http_ctx *const h)
+{
+    const struct ctx *const c = &h->ctx;
+    struct write_ctx *const w = &h->wctx;
+    struct http_response *const r = &w->r;
+    const struct http_header *const type = find_header(r, "Content-Type");
+
+    if (!r->buf.ro || r->n < GZIP_MIN || !type
+        || strncasecmp(type->value, "text/", strlen("text/"))
+        || find_header(r, "Content-Encoding"))
+        return 0;
+    else if (http_response_add_header(r, "Vary", "Accept-Encoding"))
+    {
+        fprintf(stderr, "%s: http_response_add_header failed\n", __func__);
+        return -1;
+    }
+    else if (!(encodings(c->accept_encoding) & HTTP_ENCODING_GZIP))
+        return 0;
+    else if (http_response_add_header(r, "Content-Encoding", "gzip"))
+    {
+        fprintf(stderr, "%s: http_response_add_header failed\n", __func__);
+        return -1;
+    }
+
+    /* The compressed length is not known in advance. */
+    w->chunked = true;
+
+    if (w->head)
+        return 0;
+    else if (!(w->gz = malloc(sizeof *w->gz)))
+    {
+        fprintf(stderr, "%s: malloc(3): %s\n", __func__, strerror(errno));
+        return -1;
+    }
+
+    *w->gz = (const struct gzip){0};
+
+    /* 16 is added to the window bits to write a gzip header. */
+    const int ret = deflateInit2(&w->gz->z, Z_DEFAULT_COMPRESSION,
+        Z_DEFLATED, GZIP_WBITS + 16, GZIP_MEMLEVEL, Z_DEFAULT_STRATEGY);
+
+    if (ret != Z_OK)
+    {
+        fprintf(stderr, "%s: deflateInit2 failed with %d\n", __func__, ret);
+        free(w->gz);
+        w->gz = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int prepare_response(struct http_ctx *const h)
+{
+    const struct ctx *const c = &h->ctx;
+    struct write_ctx *const w = &h->wctx;
+    struct http_response *const r = &w->r;
+
+    w->head = c->head;
+
+    if (c->close)
+        w->close = true;
+
+    if (c->op == HTTP_OP_GET && r->status == HTTP_STATUS_OK
+        && not_modified(c, r))
+        return set_not_modified(r);
+    else if (prepare_ranges(h))
+    {
+        fprintf(stderr, "%s: prepare_ranges failed\n", __func__);
+        return -1;
+    }
+    else if (prepare_gzip(h))
+    {
+        fprintf(stderr, "%s: prepare_gzip failed\n", __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int end_payload(struct http_ctx *const h, int ret)
+{
+    if (!ret && (ret = prepare_response(h)))
+        fprintf(stderr, "%s: prepare_response failed\n", __func__);
+
+    ctx_free(&h->ctx);
 
     if (ret)
         return ret;
@@ -931,6 +2064,20 @@ static int payload_post(struct http_ctx *const h, const char *const line)
     return start_response(h);
 }
 
+static int payload_get(struct http_ctx *const h, const char *const line)
+{
+    const struct http_payload p = ctx_to_payload(&h->ctx);
+
+    return call_payload(h, &p, end_payload);
+}
+
+static int payload_post(struct http_ctx *const h, const char *const line)
+{
+    const struct http_payload pl = ctx_to_payload(&h->ctx);
+
+    return call_payload(h, &pl, end_payload);
+}
+
 static int get_field_value(const char *const line, size_t *const n,
     const char **const value)
 {
@@ -957,6 +2104,14 @@ static int get_field_value(const char *const line, size_t *const n,
     return 0;
 }
 
+static int end_expect(struct http_ctx *const h, const int ret)
+{
+    if (ret)
+        return ret;
+
+    return start_response(h);
+}
+
 static int expect(struct http_ctx *const h, const char *const value)
 {
     if (!strcmp(value, "100-continue"))
@@ -975,69 +2130,80 @@ static int expect(struct http_ctx *const h, const char *const value)
             .resource = c->resource
         };
 
-        const int ret = h->cfg.payload(&p, &h->wctx.r, h->cfg.user);
-
-        if (ret)
-            return ret;
-
-        return start_response(h);
+        return call_payload(h, &p, end_expect);
     }
 
     return 0;
 }
 
+/* Perfect hash for the header names from process_header, given their
+ * first character and length. */
+#define HEADER_HASH(c, n) ((((c) | 0x20) ^ (n)) & 15)
+
 static int process_header(struct http_ctx *const h, const char *const line,
     const size_t n, const char *const value)
 {
     static const struct header
     {
         const char *header;
+        size_t n;
         int (*f)(struct http_ctx *, const char *);
-    } headers[] =
-    {
-        {
-            .header = "Cookie",
-            .f = set_cookie
-        },
+    } headers[16] =
+    {
+#define X(c, s, fn) [HEADER_HASH(c, sizeof s - 1)] = \
+    {.header = s, .n = sizeof s - 1, .f = fn},
+        X('C', "Cookie", set_cookie)
+        X('C', "Content-Length", set_length)
+        X('E', "Expect", expect)
+        X('C', "Content-Type", set_content_type)
+        X('R', "Range", set_range)
+        X('I', "If-Range", set_if_range)
+        X('I', "If-None-Match", set_if_none_match)
+        X('I', "If-Modified-Since", set_if_modified_since)
+        X('A', "Accept-Encoding", set_accept_encoding)
+        X('C', "Connection", set_connection)
+#undef X
+    };
 
-        {
-            .header = "Content-Length",
-            .f = set_length
-        },
+    const struct header *const hdr = &headers[HEADER_HASH(*line, n)];
 
-        {
-            .header = "Expect",
-            .f = expect
-        },
+    /* Header names are case-insensitive, as per RFC 9110, section 5.1. */
+    if (hdr->f && hdr->n == n && !strncasecmp(line, hdr->header, n))
+        return hdr->f(h, value);
 
-        {
-            .header = "Content-Type",
-            .f = set_content_type
-        }
-    };
+    return 0;
+}
 
-    for (size_t i = 0; i < sizeof headers / sizeof *headers; i++)
+static int end_check_length(struct http_ctx *const h, const int ret)
+{
+    if (ret)
     {
-        const struct header *const hdr = &headers[i];
-        int ret;
-
-        if (!strncasecmp(line, hdr->header, n) && (ret = hdr->f(h, value)))
-            return ret;
+        h->wctx.close = true;
+        return start_response(h);
     }
 
+    h->ctx.state = BODY_LINE;
     return 0;
 }
 
 static int check_length(struct http_ctx *const h)
 {
     struct ctx *const c = &h->ctx;
-    const struct http_cookie cookie =
-    {
-        .field = c->field,
-        .value = c->value
-    };
 
-    return h->cfg.length(c->post.len, &cookie, &h->wctx.r, h->cfg.user);
+    h->payload = ctx_to_payload(c);
+    h->resume = end_check_length;
+
+    const int ret = h->cfg.length(c->post.len, &h->payload.cookie,
+        &h->wctx.r, h->cfg.user);
+
+    return h->suspended ? 0 : end_check_length(h, ret);
+}
+
+static int form_too_large(struct http_ctx *const h)
+{
+    fprintf(stderr, "%s: exceeded maximum length: %llu\n",
+        __func__, h->ctx.post.len);
+    return reject(h, HTTP_STATUS_PAYLOAD_TOO_LARGE);
 }
 
 static int header_cr_line(struct http_ctx *const h)
@@ -1057,15 +2223,11 @@ static int header_cr_line(struct http_ctx *const h)
                 if (!c->post.len)
                     return payload_post(h, line);
                 else if (c->boundary)
-                {
-                    const int res = check_length(h);
-
-                    if (res)
-                    {
-                        h->wctx.close = true;
-                        return start_response(h);
-                    }
-                }
+                    return check_length(h);
+                else if (c->post.len > FORM_MAX
+                    || (h->cfg.form_bytes
+                        && c->post.len > h->cfg.form_bytes))
+                    return form_too_large(h);
 
                 c->state = BODY_LINE;
                 return 0;
@@ -1086,15 +2248,28 @@ static int header_cr_line(struct http_ctx *const h)
 static int send_payload(struct http_ctx *const h,
     const struct http_payload *const p)
 {
-    struct ctx *const c = &h->ctx;
-    const int ret = h->cfg.payload(p, &h->wctx.r, h->cfg.user);
+    return call_payload(h, p, end_payload);
+}
 
-    ctx_free(c);
+/* Lines from the request head are answered with an error, whereas lines
+ * from multipart bodies just close the connection. */
+static int line_too_long(struct http_ctx *const h)
+{
+    fprintf(stderr, "%s: line too long\n", __func__);
+
+    switch (h->ctx.state)
+    {
+        case START_LINE:
+            return reject(h, HTTP_STATUS_URI_TOO_LONG);
+
+        case HEADER_CR_LINE:
+            return reject(h, HTTP_STATUS_REQUEST_HEADER_FIELDS_TOO_LARGE);
 
-    if (ret)
-        return ret;
+        case BODY_LINE:
+            break;
+    }
 
-    return start_response(h);
+    return 1;
 }
 
 static int update_lstate(struct http_ctx *const h, bool *const close,
@@ -1112,7 +2287,7 @@ static int update_lstate(struct http_ctx *const h, bool *const close,
                 h->line[c->len++] = b;
             else
             {
-                fprintf(stderr, "%s: line too long\n", __func__);
+                ret = line_too_long(h);
                 goto failure;
             }
 
@@ -1135,7 +2310,7 @@ static int update_lstate(struct http_ctx *const h, bool *const close,
             }
             else
             {
-                fprintf(stderr, "%s: line too long\n", __func__);
+                ret = line_too_long(h);
                 goto failure;
             }
 
@@ -1207,10 +2382,10 @@ static int cd_fields(struct http_ctx *const h, struct form *const f,
                 fprintf(stderr, "%s: expected non-empty name\n", __func__);
                 return 1;
             }
-            else if (!(f->name = strndup(evalue, evlen)))
+            else if (!(f->name = arena_strndup(&h->ctx.arena, evalue,
+                evlen)))
             {
-                fprintf(stderr, "%s: strndup(3): %s\n",
-                    __func__, strerror(errno));
+                fprintf(stderr, "%s: arena_strndup failed\n", __func__);
                 return -1;
             }
         }
@@ -1221,9 +2396,10 @@ static int cd_fields(struct http_ctx *const h, struct form *const f,
                 fprintf(stderr, "%s: expected non-empty filename\n", __func__);
                 return 1;
             }
-            else if (!(f->filename = strndup(evalue, evlen)))
+            else if (!(f->filename = arena_strndup(&h->ctx.arena, evalue,
+                evlen)))
             {
-                fprintf(stderr, "%s: strndup(3): %s\n", __func__, strerror(errno));
+                fprintf(stderr, "%s: arena_strndup failed\n", __func__);
                 return -1;
             }
         }
@@ -1257,11 +2433,12 @@ static int set_content_disposition(struct http_ctx *const h,
     }
 
     const size_t n = m->nforms + 1;
-    struct form *const forms = realloc(m->forms, n * sizeof *m->forms);
+    struct form *const forms = arena_realloc(&h->ctx.arena, m->forms,
+        m->nforms * sizeof *m->forms, n * sizeof *m->forms);
 
     if (!forms)
     {
-        fprintf(stderr, "%s: realloc(3): %s\n", __func__, strerror(errno));
+        fprintf(stderr, "%s: arena_realloc failed\n", __func__);
         return -1;
     }
 
@@ -1283,14 +2460,6 @@ static int mf_header_cr_line(struct http_ctx *const h)
 
     if (!*line)
     {
-        const size_t n = strlen("\r\n") + strlen(c->boundary) + 1;
-
-        if (!m->boundary && !(m->boundary = calloc(1, n)))
-        {
-            fprintf(stderr, "%s: malloc(3): %s\n", __func__, strerror(errno));
-            return -1;
-        }
-
         m->state = MF_BODY_BOUNDARY_LINE;
         return 0;
     }
@@ -1358,7 +2527,6 @@ static int process_mf_line(struct http_ctx *const h)
         [MF_END_BOUNDARY_CR_LINE] = end_boundary_line
     };
 
-    h->ctx.post.read += strlen(h->line) + strlen("\r\n");
     return state[h->ctx.u.mf.state](h);
 }
 
@@ -1411,7 +2579,6 @@ static int read_mf_body_to_mem(struct http_ctx *const h, const void *const buf,
     memcpy(&h->line[m->written], buf, n);
     m->written += n;
     m->len += n;
-    c->post.read += n;
     return 0;
 }
 
@@ -1427,6 +2594,16 @@ static int read_mf_body_to_file(struct http_ctx *const h, const void *const buf,
         fprintf(stderr, "%s: generate_mf_file failed\n", __func__);
         return -1;
     }
+    else if (h->cfg.pwrite)
+    {
+        if (h->cfg.pwrite(m->fd, buf, n, m->written, h->cfg.user))
+        {
+            fprintf(stderr, "%s: pwrite failed\n", __func__);
+            return -1;
+        }
+
+        res = n;
+    }
     else if ((res = pwrite(m->fd, buf, n, m->written)) < 0)
     {
         fprintf(stderr, "%s: pwrite(2): %s\n", __func__, strerror(errno));
@@ -1435,28 +2612,9 @@ static int read_mf_body_to_file(struct http_ctx *const h, const void *const buf,
 
     m->written += res;
     m->len += res;
-    c->post.read += res;
     return 0;
 }
 
-static int reset_boundary(struct http_ctx *const h, const void *const buf,
-    const size_t n)
-{
-    struct multiform *const m = &h->ctx.u.mf;
-    struct form *const f = &m->forms[m->nforms - 1];
-    const size_t len = strlen(m->boundary);
-    int (*const read_mf)(struct http_ctx *, const void *, size_t) =
-        f->filename ? read_mf_body_to_file : read_mf_body_to_mem;
-    const int res = read_mf(h, m->boundary, len);
-
-    if (res)
-        return res;
-
-    memset(m->boundary, '\0', len);
-    m->blen = 0;
-    return read_mf(h, buf, n);
-}
-
 static int apply_from_file(struct http_ctx *const h, struct form *const f)
 {
     struct multiform *const m = &h->ctx.u.mf;
@@ -1470,12 +2628,12 @@ static int apply_from_file(struct http_ctx *const h, struct form *const f)
     m->fd = -1;
 
     const size_t n = m->nfiles + 1;
-    struct http_post_file *const files = realloc(m->files,
-        n * sizeof *m->files);
+    struct http_post_file *const files = arena_realloc(&h->ctx.arena,
+        m->files, m->nfiles * sizeof *m->files, n * sizeof *m->files);
 
     if (!files)
     {
-        fprintf(stderr, "%s: realloc(3): %s\n", __func__, strerror(errno));
+        fprintf(stderr, "%s: arena_realloc failed\n", __func__);
         return -1;
     }
 
@@ -1496,9 +2654,9 @@ static int apply_from_mem(struct http_ctx *const h, struct form *const f)
 {
     struct multiform *const m = &h->ctx.u.mf;
 
-    if (!(f->value = strndup(h->line, m->written)))
+    if (!(f->value = arena_strndup(&h->ctx.arena, h->line, m->written)))
     {
-        fprintf(stderr, "%s: strndup(3): %s\n", __func__, strerror(errno));
+        fprintf(stderr, "%s: arena_strndup failed\n", __func__);
         return -1;
     }
     else if (!strcmp(f->name, "dir"))
@@ -1515,111 +2673,83 @@ static int apply_from_mem(struct http_ctx *const h, struct form *const f)
     return 0;
 }
 
-static int read_mf_body_boundary_byte(struct http_ctx *const h, const char b,
-    const size_t len)
+static int read_mf_data(struct http_ctx *const h, const void *const buf,
+    const size_t n)
 {
-    struct ctx *const c = &h->ctx;
-    struct multiform *const m = &c->u.mf;
-
-    if (b == c->boundary[m->blen])
-    {
-        m->boundary[len] = b;
-
-        if (++m->blen >= strlen(c->boundary))
-        {
-            /* Found intermediate boundary. */
-            struct form *const f = &m->forms[m->nforms - 1];
-            const int ret = f->filename ? apply_from_file(h, f)
-                : apply_from_mem(h, f);
-
-            memset(m->boundary, '\0', len + 1);
-            m->blen = 0;
-            m->state = MF_END_BOUNDARY_CR_LINE;
-            m->written = 0;
-            return ret;
-        }
-    }
+    struct multiform *const m = &h->ctx.u.mf;
+    const struct form *const f = &m->forms[m->nforms - 1];
 
-    return 0;
+    return f->filename ? read_mf_body_to_file(h, buf, n)
+        : read_mf_body_to_mem(h, buf, n);
 }
 
-/* Similar to memmem(3), provided here to avoid the use of GNU extensions. */
-static const char *http_memmem(const char *const a, const void *const b,
-    const size_t n)
+static int found_boundary(struct http_ctx *const h)
 {
-    const size_t len = strlen(a);
-
-    if (len > n)
-        return NULL;
-
-    const char *s = a, *st = NULL;
-
-    for (size_t i = 0; i < n; i++)
-    {
-        const char *bc = b;
-        const char c = bc[i];
-
-        if (*s == c)
-        {
-            if (!st)
-                st = &bc[i];
-
-            if (!*++s)
-                return st;
-        }
-        else if (*(s = a) != c)
-            st = NULL;
-        else
-        {
-            st = &bc[i];
-
-            if (!*++s)
-                return st;
-        }
-    }
+    struct multiform *const m = &h->ctx.u.mf;
+    struct form *const f = &m->forms[m->nforms - 1];
+    const int ret = f->filename ? apply_from_file(h, f) : apply_from_mem(h, f);
 
-    return NULL;
+    m->blen = 0;
+    m->state = MF_END_BOUNDARY_CR_LINE;
+    m->written = 0;
+    return ret;
 }
 
+/* The first character from the boundary is found nowhere else in it (see
+ * set_content_type), so candidates are looked up with memchr(3), which C
+ * libraries usually vectorize, and then compared as a whole. Data that
+ * matches the start of the boundary at the end of buf is held back until
+ * more data is received. */
 static int read_mf_body_boundary(struct http_ctx *const h,
     const char **const buf, size_t *const n)
 {
     struct ctx *const c = &h->ctx;
     struct multiform *const m = &c->u.mf;
-    const char *const boundary = http_memmem(&c->boundary[m->blen], *buf, *n);
+    const char *const b = c->boundary;
+    const size_t len = strlen(b);
     int res;
 
-    if (!boundary)
+    if (m->blen)
     {
-        if ((res = reset_boundary(h, *buf, *n)))
+        const size_t rem = len - m->blen, r = rem > *n ? *n : rem;
+
+        if (!memcmp(*buf, b + m->blen, r))
+        {
+            m->blen += r;
+            *buf += r;
+            *n -= r;
+            return m->blen >= len ? found_boundary(h) : 0;
+        }
+        /* Data held back was not part of the boundary. */
+        else if ((res = read_mf_data(h, b, m->blen)))
             return res;
 
-        *n = 0;
-        return 0;
+        m->blen = 0;
     }
 
-    const size_t prev = boundary - *buf;
-
-    if ((res = reset_boundary(h, *buf, prev)))
-        return res;
-
-    *buf += prev;
-    *n -= prev;
+    const char *const end = *buf + *n;
 
-    const size_t len = strlen(m->boundary),
-        rem = strlen(c->boundary) - len,
-        r = rem > *n ? *n : rem;
-
-    for (size_t i = 0; i < r; i++)
+    for (const char *s = *buf; (s = memchr(s, *b, end - s)); s++)
     {
-        const char *const b = *buf;
+        const size_t left = end - s, r = left > len ? len : left;
 
-        if ((res = read_mf_body_boundary_byte(h, b[i], len)))
-            return res;
+        if (!memcmp(s, b, r))
+        {
+            if ((res = read_mf_data(h, *buf, s - *buf)))
+                return res;
+
+            m->blen = r;
+            *n = end - (s + r);
+            *buf = s + r;
+            return r >= len ? found_boundary(h) : 0;
+        }
     }
 
-    *buf += r;
-    *n -= r;
+    if ((res = read_mf_data(h, *buf, *n)))
+        return res;
+
+    *buf = end;
+    *n = 0;
     return 0;
 }
 
@@ -1628,7 +2758,7 @@ static int read_multiform_n(struct http_ctx *const h, bool *const close,
 {
     struct multiform *const m = &h->ctx.u.mf;
 
-    while (n)
+    while (n && !h->suspended)
     {
         int res;
 
@@ -1665,35 +2795,191 @@ static int read_multiform(struct http_ctx *const h, bool *const close)
     struct post *const p = &h->ctx.post;
     const unsigned long long left = p->len - p->read;
     const size_t rem = left > sizeof buf ? sizeof buf : left;
-    const int r = h->cfg.read(buf, rem, h->cfg.user);
+    const int r = http_recv(h, buf, rem);
 
     if (r <= 0)
         return rw_error(r, close);
 
+    p->read += r;
     return read_multiform_n(h, close, buf, r);
 }
 
-static int read_body_to_mem(struct http_ctx *const h, bool *const close)
+static int end_form(struct urlform *const u)
 {
-    char b;
-    const int r = h->cfg.read(&b, sizeof b, h->cfg.user);
+    if (u->pct)
+    {
+        fprintf(stderr, "%s: unterminated %%\n", __func__);
+        return 1;
+    }
+    else if (u->state != UF_VALUE || u->len == u->value)
+    {
+        fprintf(stderr, "%s: expected key=value\n", __func__);
+        return 1;
+    }
 
-    if (r <= 0)
-        return rw_error(r, close);
+    u->buf[u->len++] = '\0';
+    u->state = UF_KEY;
+    u->key = u->len;
+    u->n++;
+    return 0;
+}
+
+/* Bytes from application/x-www-form-urlencoded bodies to be copied as
+ * they are. */
+static size_t form_run(const char *const buf, const size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        switch (buf[i])
+        {
+            case '\0':
+            case '%':
+            case '+':
+            case '=':
+            case '&':
+                return i;
+        }
+
+    return n;
+}
+
+static int decode_form(struct urlform *const u, const char *const buf,
+    const size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        const char b = buf[i];
+
+        if (u->pct)
+        {
+            const int d = hexdigit(b);
+
+            if (d < 0)
+            {
+                fprintf(stderr, "%s: invalid hexadecimal digit %#x\n",
+                    __func__, (unsigned char)b);
+                return 1;
+            }
+
+            u->hex = u->hex << 4 | d;
+
+            if (!--u->pct)
+            {
+                if (!u->hex)
+                {
+                    fprintf(stderr, "%s: unexpected null byte\n", __func__);
+                    return 1;
+                }
+
+                u->buf[u->len++] = u->hex;
+            }
+        }
+        else if (b == '%')
+        {
+            u->pct = 2;
+            u->hex = 0;
+        }
+        /* HTML input forms use '+' for whitespace, rather than %20. */
+        else if (b == '+')
+            u->buf[u->len++] = ' ';
+        else if (b == '=' && u->state == UF_KEY)
+        {
+            u->buf[u->len++] = '\0';
+            u->state = UF_VALUE;
+            u->value = u->len;
+        }
+        else if (b == '&')
+        {
+            int ret;
+
+            if ((ret = end_form(u)))
+                return ret;
+        }
+        else if (!b)
+        {
+            fprintf(stderr, "%s: unexpected null byte\n", __func__);
+            return 1;
+        }
+        else
+        {
+            /* Copied along with the plain bytes after it, if any. */
+            const size_t run = 1 + form_run(&buf[i + 1], n - i - 1);
+
+            memcpy(&u->buf[u->len], &buf[i], run);
+            u->len += run;
+            i += run - 1;
+        }
+    }
+
+    return 0;
+}
+
+static int get_forms(struct ctx *const c)
+{
+    struct urlform *const u = &c->uf;
+
+    /* A trailing '&' is allowed. */
+    if (u->state != UF_KEY || u->pct || u->len != u->key)
+    {
+        const int ret = end_form(u);
+
+        if (ret)
+            return ret;
+    }
+
+    if (!u->n)
+        return 0;
+    else if (!(u->forms = arena_alloc(&c->arena, u->n * sizeof *u->forms)))
+    {
+        fprintf(stderr, "%s: arena_alloc failed\n", __func__);
+        return -1;
+    }
+
+    const char *s = u->buf;
+
+    for (size_t i = 0; i < u->n; i++)
+    {
+        struct http_post_form *const f = &u->forms[i];
+
+        f->key = s;
+        s += strlen(s) + 1;
+        f->value = s;
+        s += strlen(s) + 1;
+    }
+
+    return 0;
+}
 
+static int read_body_to_mem(struct http_ctx *const h, bool *const close)
+{
     struct ctx *const c = &h->ctx;
     struct post *const p = &c->post;
+    struct urlform *const u = &c->uf;
 
-    if (p->read >= sizeof h->line)
+    /* Decoding never grows the body, apart from the null character
+     * terminating the last value. p->len is at most FORM_MAX, so this
+     * cannot overflow. */
+    if (!u->buf && !(u->buf = arena_alloc(&c->arena, p->len + 1)))
     {
-        fprintf(stderr, "%s: exceeded maximum length\n", __func__);
-        return 1;
+        fprintf(stderr, "%s: arena_alloc failed\n", __func__);
+        return reject(h, HTTP_STATUS_SERVICE_UNAVAILABLE);
     }
 
-    h->line[p->read++] = b;
+    const unsigned long long left = p->len - p->read;
+    const size_t rem = left > sizeof h->line ? sizeof h->line : left;
+    const int r = http_recv(h, h->line, rem);
+    int ret;
 
-    if (p->read >= p->len)
+    if (r <= 0)
+        return rw_error(r, close);
+    else if (decode_form(u, h->line, r))
+        return reject(h, HTTP_STATUS_BAD_REQUEST);
+    else if ((p->read += r) >= p->len)
     {
+        if ((ret = get_forms(c)) < 0)
+            return reject(h, HTTP_STATUS_SERVICE_UNAVAILABLE);
+        else if (ret)
+            return reject(h, HTTP_STATUS_BAD_REQUEST);
+
         const struct http_payload pl =
         {
             .cookie =
@@ -1706,8 +2992,8 @@ static int read_body_to_mem(struct http_ctx *const h, bool *const close)
             .resource = c->resource,
             .u.post =
             {
-                .data = h->line,
-                .n = p->len
+                .forms = u->forms,
+                .n_forms = u->n
             }
         };
 
@@ -1734,6 +3020,31 @@ static int process_line(struct http_ctx *const h)
     return state[h->ctx.state](h);
 }
 
+/* Lines are parsed out of buffered data until it runs out or the request
+ * line and headers are over. */
+static int read_lines(struct http_ctx *const h, bool *const close)
+{
+    struct rbuf *const rb = &h->rb;
+    char b;
+    const int r = http_recv(h, &b, sizeof b);
+
+    if (r <= 0)
+        return rw_error(r, close);
+
+    for (;;)
+    {
+        const int ret = update_lstate(h, close, process_line, b);
+        const enum state state = h->ctx.state;
+
+        if (ret || *close || h->suspended || h->wctx.pending
+            || (state != START_LINE && state != HEADER_CR_LINE)
+            || rb->pos >= rb->len)
+            return ret;
+
+        b = rb->buf[rb->pos++];
+    }
+}
+
 static int http_read(struct http_ctx *const h, bool *const close)
 {
     switch (h->ctx.state)
@@ -1741,15 +3052,7 @@ static int http_read(struct http_ctx *const h, bool *const close)
         case START_LINE:
             /* Fall through. */
         case HEADER_CR_LINE:
-        {
-            char b;
-            const int r = h->cfg.read(&b, sizeof b, h->cfg.user);
-
-            if (r <= 0)
-                return rw_error(r, close);
-
-            return update_lstate(h, close, process_line, b);
-        }
+            return read_lines(h, close);
 
         case BODY_LINE:
             return read_body(h, close);
@@ -1791,6 +3094,24 @@ static int append_expire(struct dynstr *const d)
     return 0;
 }
 
+int http_date(const time_t t, char *const buf, const size_t n)
+{
+    struct tm tm;
+
+    if (!gmtime_r(&t, &tm))
+    {
+        fprintf(stderr, "%s: gmtime_r(3): %s\n", __func__, strerror(errno));
+        return -1;
+    }
+    else if (!strftime(buf, n, "%a, %d %b %Y %H:%M:%S GMT", &tm))
+    {
+        fprintf(stderr, "%s: strftime(3) failed\n", __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
 char *http_cookie_create(const char *const key, const char *const value)
 {
     struct dynstr d;
@@ -1818,12 +3139,61 @@ int http_update(struct http_ctx *const h, bool *const write, bool *const close)
     return ret;
 }
 
+void http_suspend(struct http_ctx *const h)
+{
+    h->suspended = true;
+}
+
+int http_resume(struct http_ctx *const h, const int ret, bool *const write)
+{
+    h->suspended = false;
+
+    const int res = h->resume(h, ret);
+
+    *write = h->wctx.pending;
+    return res;
+}
+
+enum http_phase http_phase(const struct http_ctx *const h)
+{
+    const struct ctx *const c = &h->ctx;
+
+    if (h->wctx.pending)
+        return HTTP_PHASE_WRITE;
+
+    switch (c->state)
+    {
+        case START_LINE:
+            return c->len || c->lstate != LINE_CR || h->rb.pos < h->rb.len ?
+                HTTP_PHASE_HEADER : HTTP_PHASE_IDLE;
+
+        case HEADER_CR_LINE:
+            return HTTP_PHASE_HEADER;
+
+        case BODY_LINE:
+            break;
+    }
+
+    return HTTP_PHASE_BODY;
+}
+
+void http_reset(struct http_ctx *const h)
+{
+    ctx_free(&h->ctx);
+    write_ctx_free(&h->wctx);
+    h->rb.pos = h->rb.len = 0;
+    h->suspended = false;
+    h->requests = 0;
+}
+
 void http_free(struct http_ctx *const h)
 {
     if (h)
     {
         ctx_free(&h->ctx);
         write_ctx_free(&h->wctx);
+        arena_free(&h->ctx.arena);
+        arena_free(&h->wctx.arena);
     }
 
     free(h);
@@ -1851,104 +3221,106 @@ failure:
     return NULL;
 }
 
-char *http_encode_url(const char *url)
+/* Unreserved characters, as defined by RFC 3986, section 2.3, plus '/'
+ * so that paths keep their separators. Ranges are compared directly:
+ * strspn(3) builds a table from its accept set on every call, which costs
+ * more than the short runs found in paths save. */
+static bool unreserved(const unsigned char c)
 {
-    struct dynstr d;
-    char c;
+    switch (c)
+    {
+        case '-':
+        case '.':
+        case '_':
+        case '~':
+        case '/':
+            return true;
+    }
 
-    dynstr_init(&d);
+    return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z')
+        || (c >= '0' && c <= '9');
+}
+
+size_t http_encode_url(const char *url, char *const buf, const size_t n)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    size_t len = 0;
 
-    while ((c = *url++))
+    for (; *url; url++)
     {
-        /* Unreserved characters must not be percent-encoded. */
-        if ((c >= 'A' && c <= 'Z')
-            || (c >= 'a' && c <= 'z')
-            || (c == '-')
-            || (c == '_')
-            || (c == '.')
-            || (c == '/')
-            || (c == '~'))
+        const unsigned char c = *url;
+
+        if (unreserved(c))
         {
-            if (dynstr_append(&d, "%c", c))
-            {
-                fprintf(stderr, "%s: dynstr_append failed\n", __func__);
-                goto failure;
-            }
+            if (len < n)
+                buf[len] = c;
+
+            len++;
         }
-        else if (dynstr_append(&d, "%%%hhx", c))
+        else
         {
-            fprintf(stderr, "%s: dynstr_append failed\n", __func__);
-            goto failure;
+            const char pct[] = {'%', hex[c >> 4], hex[c & 0xf]};
+
+            for (size_t i = 0; i < sizeof pct; i++, len++)
+                if (len < n)
+                    buf[len] = pct[i];
         }
     }
 
-    return d.str;
+    if (n)
+        buf[len < n ? len : n - 1] = '\0';
 
-failure:
-    dynstr_free(&d);
-    return NULL;
+    return len;
 }
 
-char *http_decode_url(const char *url, const bool spaces)
+int http_decode_url(char *const url, const bool spaces)
 {
-    char *ret = NULL;
-    size_t n = 0;
+    const char *const special = spaces ? "%+" : "%";
+    const char *src = url;
+    char *dst = url;
 
-    while (*url)
+    for (;;)
     {
-        char *const r = realloc(ret, n + 1);
+        const size_t run = strcspn(src, special);
 
-        if (!r)
-        {
-            fprintf(stderr, "%s: realloc(3) loop: %s\n",
-                __func__, strerror(errno));
-            goto failure;
-        }
+        if (dst != src)
+            memmove(dst, src, run);
 
-        ret = r;
+        dst += run;
+        src += run;
 
-        if (spaces && *url == '+')
+        if (!*src)
+            break;
+        else if (*src == '+')
         {
-            ret[n++] = ' ';
-            url++;
+            *dst++ = ' ';
+            src++;
         }
-        else if (*url != '%')
-            ret[n++] = *url++;
-        else if (*(url + 1) && *(url + 2))
+        else if (*(src + 1) && *(src + 2))
         {
-            const char buf[sizeof "00"] = {*(url + 1), *(url + 2)};
-            char *endptr;
-            const unsigned long res = strtoul(buf, &endptr, 16);
+            const int hi = hexdigit(*(src + 1)), lo = hexdigit(*(src + 2));
 
-            if (*endptr)
+            if (hi < 0 || lo < 0)
             {
-                fprintf(stderr, "%s: invalid number %s\n", __func__, buf);
-                goto failure;
+                fprintf(stderr, "%s: invalid number %.2s\n", __func__, src + 1);
+                return 1;
+            }
+            else if (!hi && !lo)
+            {
+                fprintf(stderr, "%s: unexpected null byte\n", __func__);
+                return 1;
             }
 
-            url += 3;
-            ret[n++] = res;
+            *dst++ = hi << 4 | lo;
+            src += 3;
         }
         else
         {
             fprintf(stderr, "%s: unterminated %%\n", __func__);
-            goto failure;
+            return 1;
         }
     }
 
-    char *const r = realloc(ret, n + 1);
-
-    if (!r)
-    {
-        fprintf(stderr, "%s: realloc(3) end: %s\n", __func__, strerror(errno));
-        goto failure;
-    }
-
-    ret = r;
-    ret[n] = '\0';
-    return ret;
-
-failure:
-    free(ret);
-    return NULL;
+    *dst = '\0';
+    return 0;
 }
@@ -1,9 +1,18 @@
 #ifndef HTTP_H
 #define HTTP_H
 
+#include <sys/types.h>
+#include <sys/uio.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <time.h>
+
+enum
+{
+    HTTP_ENCODING_GZIP = 1 << 0,
+    HTTP_ENCODING_ZSTD = 1 << 1
+};
 
 struct http_payload
 {
@@ -14,6 +23,8 @@ struct http_payload
     } op;
 
     const char *resource;
+    /* Content codings accepted by the client, from Accept-Encoding. */
+    unsigned encodings;
 
     struct http_cookie
     {
@@ -25,7 +36,6 @@ struct http_payload
         struct http_post
         {
             bool expect_continue;
-            const void *data;
             size_t n;
             const char *dir;
 
@@ -33,6 +43,15 @@ struct http_payload
             {
                 const char *tmpname, *filename;
             } *files;
+
+            /* Fields from application/x-www-form-urlencoded bodies,
+             * already decoded. */
+            const struct http_post_form
+            {
+                const char *key, *value;
+            } *forms;
+
+            size_t n_forms;
         } post;
     } u;
 
@@ -47,13 +66,20 @@ struct http_payload
 #define HTTP_STATUSES \
     X(CONTINUE, "Continue", 100) \
     X(OK, "OK", 200) \
+    X(PARTIAL_CONTENT, "Partial Content", 206) \
     X(SEE_OTHER, "See other", 303) \
+    X(NOT_MODIFIED, "Not Modified", 304) \
     X(BAD_REQUEST, "Bad Request", 400) \
     X(UNAUTHORIZED, "Unauthorized", 401) \
     X(FORBIDDEN, "Forbidden", 403) \
     X(NOT_FOUND, "Not found", 404) \
     X(PAYLOAD_TOO_LARGE, "Payload too large", 413) \
-    X(INTERNAL_ERROR, "Internal Server Error", 500)
+    X(URI_TOO_LONG, "URI Too Long", 414) \
+    X(RANGE_NOT_SATISFIABLE, "Range Not Satisfiable", 416) \
+    X(REQUEST_HEADER_FIELDS_TOO_LARGE, \
+        "Request Header Fields Too Large", 431) \
+    X(INTERNAL_ERROR, "Internal Server Error", 500) \
+    X(SERVICE_UNAVAILABLE, "Service Unavailable", 503)
 
 struct http_response
 {
@@ -66,7 +92,8 @@ struct http_response
 
     struct http_header
     {
-        char *header, *value;
+        const char *header;
+        char *value;
     } *headers;
 
     union
@@ -85,22 +112,74 @@ struct http_cfg
 {
     int (*read)(void *buf , size_t n, void *user);
     int (*write)(const void *buf, size_t n, void *user);
+    /* Same semantics as writev(2), so that the status line, headers and
+     * body can be sent with a single call. */
+    int (*writev)(const struct iovec *iov, int n, void *user);
+    /* Optional. Writes file bodies from their file descriptor without
+     * copying them into user space, otherwise they are read into a
+     * buffer first. Same semantics as sendfile(2). */
+    int (*sendfile)(int fd, off_t *off, size_t n, void *user);
+    /* Optional. Writes n bytes from buf into fd, the temporary file for an
+     * upload, at offset off, possibly in the background, in which case
+     * payload must wait for them to complete. Otherwise, pwrite(2) is
+     * used. Returns zero on success. */
+    int (*pwrite)(int fd, const void *buf, size_t n, off_t off, void *user);
     int (*payload)(const struct http_payload *p, struct http_response *r,
         void *user);
     int (*length)(unsigned long long len, const struct http_cookie *c,
         struct http_response *r, void *user);
     const char *tmpdir;
+    /* Maximum length of bodies not sent as multipart/form-data, which are
+     * kept in memory. Zero means the built-in maximum of 1 MiB, which
+     * cannot be exceeded anyway. */
+    unsigned long form_bytes;
+    /* Requests served per connection, after which it is closed. Zero
+     * means no limit. */
+    unsigned long max_requests;
     void *user;
 };
 
 struct http_ctx *http_alloc(const struct http_cfg *cfg);
 void http_free(struct http_ctx *h);
+/* Releases any resources from the current request or response, so that h
+ * can be reused by another connection. */
+void http_reset(struct http_ctx *h);
 /* Positive return value: user input error, negative: fatal error. */
 int http_update(struct http_ctx *h, bool *write, bool *close);
+/* Called from the payload or length callbacks so that h is not processed
+ * further until http_resume is called with the callback result. Callback
+ * arguments remain valid meanwhile. */
+void http_suspend(struct http_ctx *h);
+/* Same return values as http_update. */
+int http_resume(struct http_ctx *h, int ret, bool *write);
+
+enum http_phase
+{
+    /* Waiting for a new request. */
+    HTTP_PHASE_IDLE,
+    HTTP_PHASE_HEADER,
+    HTTP_PHASE_BODY,
+    HTTP_PHASE_WRITE
+};
+
+enum http_phase http_phase(const struct http_ctx *h);
+/* r must be the response given to the payload or length callbacks. */
 int http_response_add_header(struct http_response *r, const char *header,
     const char *value);
+/* Memory released along with r once sent, so that handlers can build
+ * responses without freeing them. r is the same as above. */
+void *http_response_alloc(struct http_response *r, size_t n);
 char *http_cookie_create(const char *key, const char *value);
-char *http_encode_url(const char *url);
-char *http_decode_url(const char *url, bool spaces);
+/* Writes t into buf as an HTTP-date, as defined by RFC 9110, section
+ * 5.6.7. */
+int http_date(time_t t, char *buf, size_t n);
+/* Writes url percent-encoded into buf, with the same semantics as
+ * snprintf(3), so that buf can be sized by a first call with n set to
+ * zero. */
+size_t http_encode_url(const char *url, char *buf, size_t n);
+/* Decodes url in place, since decoded strings are never longer than
+ * their encoded form. If spaces is true, '+' is decoded as whitespace.
+ * Positive return value: invalid input. */
+int http_decode_url(char *url, bool spaces);
 
 #endif /* HTTP_H */
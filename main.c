@@ -6,6 +6,8 @@
 #include "hex.h"
 #include "http.h"
 #include "page.h"
+#include "server.h"
+#include "sidecar.h"
 #include "wildcard_cmp.h"
 #include <openssl/err.h>
 #include <openssl/rand.h>
@@ -23,11 +25,6 @@
 #include <stdlib.h>
 #include <string.h>
 
-struct form
-{
-    char *key, *value;
-};
-
 static int redirect(struct http_response *const r)
 {
     *r = (const struct http_response)
@@ -61,166 +58,9 @@ static int serve_style(const struct http_payload *const p,
     return page_style(r);
 }
 
-static char *alloc_form_data(const char *const s, const char **const end)
-{
-    const char *const next = strchr(s, '&');
-    const size_t len = next ? next - s : strlen(s);
-    char *const data = malloc(len + 1);
-
-    if (!data)
-    {
-        fprintf(stderr, "%s: malloc(3): %s\n", __func__, strerror(errno));
-        return NULL;
-    }
-
-    memcpy(data, s, len);
-    data[len] = '\0';
-    *end = s + len;
-
-    if (next)
-        *end += 1;
-
-    return data;
-}
-
-static void form_free(struct form *const f)
-{
-    if (f)
-    {
-        free(f->key);
-        free(f->value);
-    }
-}
-
-static void forms_free(struct form *const f, const size_t n)
-{
-    if (f)
-        for (size_t i = 0; i < n; i++)
-            form_free(&f[i]);
-
-    free(f);
-}
-
-static int append_form(struct form **const forms, const char **const s,
-    size_t *const n)
-{
-    int ret = -1;
-    const char *end;
-    char *const data = alloc_form_data(*s, &end), *key = NULL, *value = NULL;
-    struct form *f = NULL, *fs = NULL;
-
-    if (!data)
-    {
-        fprintf(stderr, "%s: alloc_form_data failed\n", __func__);
-        goto end;
-    }
-
-    const char *const sep = strchr(data, '=');
-
-    if (!sep)
-    {
-        fprintf(stderr, "%s: strchr(3) returned NULL\n", __func__);
-        ret = 1;
-        goto end;
-    }
-    else if (!data || !*(sep + 1))
-    {
-        fprintf(stderr, "%s: expected key=value (%s)\n", __func__, data);
-        ret = 1;
-        goto end;
-    }
-
-    const size_t keylen = sep - data;
-
-    if (!(key = strndup(data, keylen)))
-    {
-        fprintf(stderr, "%s: strndup(3) key: %s\n", __func__, strerror(errno));
-        goto end;
-    }
-    else if (!(value = strdup(sep + 1)))
-    {
-        fprintf(stderr, "%s: strdup(3) value: %s\n", __func__, strerror(errno));
-        goto end;
-    }
-    else if (!(fs = realloc(*forms, (*n + 1) * sizeof **forms)))
-    {
-        fprintf(stderr, "%s: realloc(3): %s\n", __func__, strerror(errno));
-        goto end;
-    }
-
-    *forms = fs;
-    f = &(*forms)[(*n)++];
-
-    /* HTML input forms use '+' for whitespace, rather than %20. */
-    *f = (const struct form)
-    {
-        .key = http_decode_url(key, true),
-        .value = http_decode_url(value, true)
-    };
-
-    if (!f->key || !f->value)
-    {
-        fprintf(stderr, "%s: http_decode_url key/value failed\n", __func__);
-        goto end;
-    }
-
-    *s = end;
-    ret = 0;
-
-end:
-    free(key);
-    free(value);
-    free(data);
-    return ret;
-}
-
-static int get_forms(const struct http_payload *const pl,
-    struct form **const forms, size_t *const outn)
-{
-    int ret = -1;
-    const struct http_post *const p = &pl->u.post;
-    const char *const ref = p->data;
-    char *dup = NULL;
-    struct form *f = NULL;
-
-    if (!ref)
-    {
-        fprintf(stderr, "%s: expected non-NULL buffer\n", __func__);
-        goto end;
-    }
-    else if (!(dup = strndup(ref, p->n)))
-    {
-        fprintf(stderr, "%s: strndup(3): %s\n", __func__, strerror(errno));
-        goto end;
-    }
-
-    const char *s = dup;
-
-    *outn = 0;
-
-    while (*s)
-        if ((ret = append_form(&f, &s, outn)))
-        {
-            if (ret < 0)
-                fprintf(stderr, "%s: append_form failed\n", __func__);
-
-            goto end;
-        }
-
-    *forms = f;
-    ret = 0;
-
-end:
-    free(dup);
-
-    if (ret)
-        forms_free(f, *outn);
-
-    return ret;
-}
-
 static int check_credentials(struct auth *const a,
-    const struct form *const forms, const size_t n, char **const cookie)
+    const struct http_post_form *const forms, const size_t n,
+    char **const cookie)
 {
     const char *username = NULL, *pwd = NULL;
 
@@ -228,7 +68,7 @@ static int check_credentials(struct auth *const a,
 
     for (size_t i = 0; i < n; i++)
     {
-        const struct form *const f = &forms[i];
+        const struct http_post_form *const f = &forms[i];
 
         if (!strcmp(f->key, "username"))
             username = f->value;
@@ -254,19 +94,11 @@ static int login(const struct http_payload *const pl,
     struct http_response *const r, void *const user)
 {
     int ret = -1;
-    size_t n = 0;
-    struct form *forms = NULL;
+    const struct http_post *const po = &pl->u.post;
     struct auth *const a = user;
     char *cookie = NULL;
 
-    if ((ret = get_forms(pl, &forms, &n)))
-    {
-        if (ret < 0)
-            fprintf(stderr, "%s: get_forms failed\n", __func__);
-
-        goto end;
-    }
-    else if ((ret = check_credentials(a, forms, n, &cookie)))
+    if ((ret = check_credentials(a, po->forms, po->n_forms, &cookie)))
     {
         if (ret < 0)
             fprintf(stderr, "%s: check_credentials failed\n", __func__);
@@ -288,7 +120,6 @@ static int login(const struct http_payload *const pl,
     ret = 0;
 
 end:
-    forms_free(forms, n);
     free(cookie);
 
     if (ret > 0 && (ret = page_failed_login(r)))
@@ -470,8 +301,7 @@ static int check_search_input(const struct http_payload *const p,
     char **const dir, struct dynstr *const res)
 {
     int ret = auth_cookie(a, &p->cookie);
-    struct form *forms = NULL;
-    size_t n = 0;
+    const struct http_post *const po = &p->u.post;
 
     if (ret < 0)
     {
@@ -483,21 +313,12 @@ static int check_search_input(const struct http_payload *const p,
         *f = page_forbidden;
         goto end;
     }
-    else if ((ret = get_forms(p, &forms, &n)))
-    {
-        if (ret < 0)
-            fprintf(stderr, "%s: get_forms failed\n", __func__);
-        else
-            *f = page_bad_request;
-
-        goto end;
-    }
 
     const char *tdir = NULL, *tres = NULL;
 
-    for (size_t i = 0; i < n; i++)
+    for (size_t i = 0; i < po->n_forms; i++)
     {
-        const struct form *const f = &forms[i];
+        const struct http_post_form *const f = &po->forms[i];
 
         if (!strcmp(f->key, "dir"))
             tdir = f->value;
@@ -547,7 +368,6 @@ static int check_search_input(const struct http_payload *const p,
     }
 
 end:
-    forms_free(forms, n);
     return ret;
 }
 
@@ -718,27 +538,18 @@ static int share(const struct http_payload *const p,
     }
 
     int ret = -1;
-    struct form *forms = NULL;
-    size_t n = 0;
+    const struct http_post *const po = &p->u.post;
+    const size_t n = po->n_forms;
     char *sympath = NULL;
 
-    if ((ret = get_forms(p, &forms, &n)))
-    {
-        if (ret < 0)
-            fprintf(stderr, "%s: get_forms failed\n", __func__);
-        else
-            ret = page_bad_request(r);
-
-        goto end;
-    }
-    else if (n != 1)
+    if (n != 1)
     {
         fprintf(stderr, "%s: expected 1 form, got %zu\n", __func__, n);
         ret = page_bad_request(r);
         goto end;
     }
 
-    const char *const path = forms->value, *const username = p->cookie.field;
+    const char *const path = po->forms->value, *const username = p->cookie.field;
 
     if (path_isrel(path))
     {
@@ -760,7 +571,6 @@ static int share(const struct http_payload *const p,
     ret = 0;
 
 end:
-    forms_free(forms, n);
     free(sympath);
     return ret;
 }
@@ -873,13 +683,14 @@ static int getnode(const struct http_payload *const p,
     }
 
     int ret = -1;
-    struct dynstr dir, root, d;
+    struct dynstr dir, root, d, sc;
     const char *const adir = auth_dir(a),
         *const sep = p->resource[strlen(p->resource) - 1] != '/' ? "/" : "";
 
     dynstr_init(&dir);
     dynstr_init(&d);
     dynstr_init(&root);
+    dynstr_init(&sc);
 
     if (!adir)
     {
@@ -892,7 +703,8 @@ static int getnode(const struct http_payload *const p,
         goto end;
     }
     else if (dynstr_append(&root, "%s/user/%s/", adir, username)
-        || dynstr_append(&d, "%s%s", root.str, resource))
+        || dynstr_append(&d, "%s%s", root.str, resource)
+        || dynstr_append(&sc, "%s/sidecar/%s/%s", adir, username, resource))
     {
         fprintf(stderr, "%s: dynstr_append failed\n", __func__);
         goto end;
@@ -920,6 +732,8 @@ static int getnode(const struct http_payload *const p,
         .dir = dir.str,
         .root = root.str,
         .res = d.str,
+        .sidecar = sc.str,
+        .encodings = p->encodings,
         .q = available ?
             &(const struct page_quota) {.cur = cur, .max = max }
             : NULL
@@ -931,6 +745,7 @@ end:
     dynstr_free(&dir);
     dynstr_free(&d);
     dynstr_free(&root);
+    dynstr_free(&sc);
     return ret;
 }
 
@@ -1049,39 +864,31 @@ end:
 static int redirect_to_dir(const char *const dir,
     struct http_response *const r)
 {
-    int ret = -1;
-    struct dynstr d;
-    char *const encdir = http_encode_url(dir);
-
-    dynstr_init(&d);
+    static const char prefix[] = "/user";
+    const size_t pn = strlen(prefix), n = http_encode_url(dir, NULL, 0) + 1;
+    char *location;
 
     *r = (const struct http_response)
     {
         .status = HTTP_STATUS_SEE_OTHER
     };
 
-    if (!encdir)
-    {
-        fprintf(stderr, "%s: http_encode_url failed\n", __func__);
-        goto end;
-    }
-    else if (dynstr_append(&d, "/user%s", encdir))
+    if (!(location = http_response_alloc(r, pn + n)))
     {
-        fprintf(stderr, "%s: dynstr_append failed\n", __func__);
-        goto end;
+        fprintf(stderr, "%s: http_response_alloc failed\n", __func__);
+        return -1;
     }
-    else if (http_response_add_header(r, "Location", d.str))
+
+    memcpy(location, prefix, pn);
+    http_encode_url(dir, &location[pn], n);
+
+    if (http_response_add_header(r, "Location", location))
     {
         fprintf(stderr, "%s: http_response_add_header failed\n", __func__);
-        goto end;
+        return -1;
     }
 
-    ret = 0;
-
-end:
-    free(encdir);
-    dynstr_free(&d);
-    return ret;
+    return 0;
 }
 
 static int upload_files(const struct http_payload *const p,
@@ -1162,8 +969,9 @@ static int createdir(const struct http_payload *const p,
     int ret = -1;
     struct auth *const a = user;
     struct dynstr d, userd;
-    struct form *forms = NULL;
-    size_t n = 0;
+    const struct http_post *const po = &p->u.post;
+    const struct http_post_form *const forms = po->forms;
+    const size_t n = po->n_forms;
 
     dynstr_init(&d);
     dynstr_init(&userd);
@@ -1174,15 +982,6 @@ static int createdir(const struct http_payload *const p,
         ret = page_forbidden(r);
         goto end;
     }
-    else if ((ret = get_forms(p, &forms, &n)))
-    {
-        if (ret < 0)
-            fprintf(stderr, "%s: get_forms failed\n", __func__);
-        else
-            ret = page_bad_request(r);
-
-        goto end;
-    }
     else if (n != 2)
     {
         fprintf(stderr, "%s: expected 2 forms, got %zu\n", __func__, n);
@@ -1190,11 +989,11 @@ static int createdir(const struct http_payload *const p,
         goto end;
     }
 
-    char *name = NULL, *dir = NULL;
+    const char *name = NULL, *dir = NULL;
 
     for (size_t i = 0; i < n; i++)
     {
-        const struct form *const f = &forms[i];
+        const struct http_post_form *const f = &forms[i];
 
         if (!strcmp(f->key, "name"))
             name = f->value;
@@ -1287,7 +1086,6 @@ static int createdir(const struct http_payload *const p,
     ret = 0;
 
 end:
-    forms_free(forms, n);
     dynstr_free(&userd);
     dynstr_free(&d);
     return ret;
@@ -1295,26 +1093,152 @@ end:
 
 static void usage(char *const argv[])
 {
-    fprintf(stderr, "%s [-t tmpdir] [-p port] dir\n", *argv);
+    fprintf(stderr, "%s [-t tmpdir] [-p port] [-b address] [-u socket] "
+        "[-j threads] [-w workers] [-q backlog] [-O option=value[,...]] "
+        "[-T timeout=seconds[,...]] [-L limit=value[,...]] [-H socket] "
+        "[-z bytes] dir\n", *argv);
+}
+
+struct pair
+{
+    const char *name;
+    unsigned long *value;
+};
+
+/* Parses a comma-separated list of name=value pairs. */
+static int parse_pairs(const char *s, const struct pair *const pairs,
+    const size_t n)
+{
+    for (;;)
+    {
+        const char *const eq = strchr(s, '=');
+        const struct pair *to = NULL;
+
+        if (!eq)
+        {
+            fprintf(stderr, "%s: expected name=value: %s\n", __func__, s);
+            return -1;
+        }
+
+        for (size_t i = 0; i < n; i++)
+        {
+            const char *const name = pairs[i].name;
+
+            if (strlen(name) == eq - s && !strncmp(s, name, eq - s))
+            {
+                to = &pairs[i];
+                break;
+            }
+        }
+
+        if (!to)
+        {
+            fprintf(stderr, "%s: unknown name %.*s\n",
+                __func__, (int)(eq - s), s);
+            return -1;
+        }
+
+        char *endptr;
+        const unsigned long value = strtoul(eq + 1, &endptr, 10);
+
+        if (endptr == eq + 1 || (*endptr && *endptr != ','))
+        {
+            fprintf(stderr, "%s: invalid value for %s: %s\n",
+                __func__, to->name, eq + 1);
+            return -1;
+        }
+
+        *to->value = value;
+
+        if (!*endptr)
+            break;
+
+        s = endptr + 1;
+    }
+
+    return 0;
+}
+
+static int parse_timeouts(const char *const s,
+    struct handler_timeouts *const t)
+{
+    const struct pair pairs[] =
+    {
+        {.name = "header", .value = &t->header},
+        {.name = "body", .value = &t->body},
+        {.name = "write", .value = &t->write},
+        {.name = "idle", .value = &t->idle},
+        {.name = "drain", .value = &t->drain}
+    };
+
+    return parse_pairs(s, pairs, sizeof pairs / sizeof *pairs);
+}
+
+static int parse_limits(const char *const s, struct handler_limits *const l)
+{
+    const struct pair pairs[] =
+    {
+        {.name = "clients", .value = &l->clients},
+        {.name = "uploads", .value = &l->uploads},
+        {.name = "upload_bytes", .value = &l->upload_bytes},
+        {.name = "form_bytes", .value = &l->form_bytes},
+        {.name = "requests", .value = &l->requests}
+    };
+
+    return parse_pairs(s, pairs, sizeof pairs / sizeof *pairs);
+}
+
+static int parse_tcp_options(const char *const s,
+    struct server_cfg *const cfg)
+{
+    const struct pair pairs[] =
+    {
+        {.name = "defer_accept", .value = &cfg->defer_accept},
+        {.name = "fastopen", .value = &cfg->fastopen}
+    };
+
+    return parse_pairs(s, pairs, sizeof pairs / sizeof *pairs);
 }
 
 static int parse_args(const int argc, char *const argv[],
-    const char **const dir, unsigned short *const port,
-    const char **const tmpdir)
+    const char **const dir, struct server_cfg *const scfg,
+    struct handler_cfg *const hcfg, unsigned long long *const sidecar)
 {
     const char *const envtmp = getenv("TMPDIR");
     int opt;
 
     /* Default values. */
-    *port = 0;
-    *tmpdir = envtmp ? envtmp : "/tmp";
+    *sidecar = 0;
+    *scfg = (const struct server_cfg){0};
+    *hcfg = (const struct handler_cfg)
+    {
+        .tmpdir = envtmp ? envtmp : "/tmp",
+        .n_shards = 1,
+        .n_workers = 4,
+        .timeouts =
+        {
+            .header = 30,
+            .body = 60,
+            .write = 60,
+            .idle = 60,
+            .drain = 600
+        },
+
+        .limits =
+        {
+            .clients = 1024,
+            .uploads = 64,
+            .form_bytes = 8000,
+            .requests = 1000
+        }
+    };
 
-    while ((opt = getopt(argc, argv, "t:p:")) != -1)
+    while ((opt = getopt(argc, argv, "t:p:b:u:j:w:q:O:T:L:H:z:")) != -1)
     {
         switch (opt)
         {
             case 't':
-                *tmpdir = optarg;
+                hcfg->tmpdir = optarg;
                 break;
 
             case 'p':
@@ -1328,7 +1252,101 @@ static int parse_args(const int argc, char *const argv[],
                     return -1;
                 }
 
-                *port = portul;
+                scfg->port = portul;
+            }
+                break;
+
+            case 'b':
+                scfg->addr = optarg;
+                break;
+
+            case 'u':
+                scfg->path = optarg;
+                break;
+
+            case 'j':
+            {
+                char *endptr;
+                const unsigned long n = strtoul(optarg, &endptr, 10);
+
+                if (*endptr || !n || n > SIZE_MAX)
+                {
+                    fprintf(stderr, "%s: invalid number of threads %s\n",
+                        __func__, optarg);
+                    return -1;
+                }
+
+                hcfg->n_shards = n;
+            }
+                break;
+
+            case 'w':
+            {
+                char *endptr;
+                const unsigned long n = strtoul(optarg, &endptr, 10);
+
+                if (*endptr || n > SIZE_MAX)
+                {
+                    fprintf(stderr, "%s: invalid number of workers %s\n",
+                        __func__, optarg);
+                    return -1;
+                }
+
+                hcfg->n_workers = n;
+            }
+                break;
+
+            case 'q':
+            {
+                char *endptr;
+                const unsigned long n = strtoul(optarg, &endptr, 10);
+
+                if (*endptr || !n || n > INT_MAX)
+                {
+                    fprintf(stderr, "%s: invalid backlog %s\n",
+                        __func__, optarg);
+                    return -1;
+                }
+
+                scfg->backlog = n;
+            }
+                break;
+
+            case 'O':
+                if (parse_tcp_options(optarg, scfg))
+                    return -1;
+
+                break;
+
+            case 'T':
+                if (parse_timeouts(optarg, &hcfg->timeouts))
+                    return -1;
+
+                break;
+
+            case 'L':
+                if (parse_limits(optarg, &hcfg->limits))
+                    return -1;
+
+                break;
+
+            case 'H':
+                hcfg->handoff = optarg;
+                break;
+
+            case 'z':
+            {
+                char *endptr;
+
+                errno = 0;
+                *sidecar = strtoull(optarg, &endptr, 10);
+
+                if (errno || *endptr || !*sidecar)
+                {
+                    fprintf(stderr, "%s: invalid size %s\n",
+                        __func__, optarg);
+                    return -1;
+                }
             }
                 break;
 
@@ -1343,6 +1361,11 @@ static int parse_args(const int argc, char *const argv[],
         usage(argv);
         return -1;
     }
+    else if (scfg->path && scfg->addr)
+    {
+        fprintf(stderr, "%s: -u and -b are mutually exclusive\n", __func__);
+        return -1;
+    }
 
     *dir = argv[optind];
     return 0;
@@ -1429,20 +1452,20 @@ int main(const int argc, char *const argv[])
     int ret = EXIT_FAILURE;
     struct handler *h = NULL;
     struct auth *a = NULL;
-    const char *dir, *tmpdir;
-    unsigned short port;
+    struct sidecar *s = NULL;
+    const char *dir;
+    struct server_cfg scfg;
+    struct handler_cfg cfg;
+    unsigned long long sidecar;
 
-    if (parse_args(argc, argv, &dir, &port, &tmpdir)
+    if (parse_args(argc, argv, &dir, &scfg, &cfg, &sidecar)
         || init_dirs(dir)
-        || !(a = auth_alloc(dir)))
+        || !(a = auth_alloc(dir))
+        || (sidecar && !(s = sidecar_alloc(dir, sidecar))))
         goto end;
 
-    const struct handler_cfg cfg =
-    {
-        .length = check_length,
-        .tmpdir = tmpdir,
-        .user = a
-    };
+    cfg.length = check_length;
+    cfg.user = a;
 
     if (!(h = handler_alloc(&cfg))
         || handler_add(h, "/", HTTP_OP_GET, serve_index, a)
@@ -1456,12 +1479,13 @@ int main(const int argc, char *const argv[])
         || handler_add(h, "/share", HTTP_OP_POST, share, a)
         || handler_add(h, "/upload", HTTP_OP_POST, upload, a)
         || handler_add(h, "/mkdir", HTTP_OP_POST, createdir, a)
-        || handler_listen(h, port))
+        || handler_listen(h, &scfg))
         goto end;
 
     ret = EXIT_SUCCESS;
 
 end:
+    sidecar_free(s);
     auth_free(a);
     handler_free(h);
     return ret;
@@ -1077,13 +1077,32 @@ end:
     return ret;
 }
 
+/* Compressed copy of a file, sent instead of it. */
+struct encoded
+{
+    const char *path, *coding;
+};
+
+/* cache is sent as Cache-Control. Files can be replaced at any time, so
+ * callers should require revalidation with the validators sent here. e
+ * is optional. */
 static int serve_file(struct http_response *const r,
-    const struct stat *const sb, const char *const res, const bool preview)
+    const struct stat *const sb, const char *const res, const bool preview,
+    const char *const cache, const struct encoded *const e)
 {
     int ret = -1;
-    FILE *const f = fopen(res, "rb");
+    FILE *const f = fopen(e ? e->path : res, "rb");
     struct dynstr b, d;
-    char *bn;
+    struct stat esb;
+    char *bn, date[sizeof "Thu, 01 Jan 1970 00:00:00 GMT"],
+        etag[sizeof "\"ffffffffffffffff-ffffffffffffffff-"
+            "ffffffffffffffff.ffffffffffffffff-gzip\""];
+    /* Any change to the file is assumed to change either of these. Each
+     * coding is a different representation, with its own tag. */
+    const int n = snprintf(etag, sizeof etag, "\"%jx-%jx-%jx.%lx%s%s\"",
+        (uintmax_t)sb->st_ino, (uintmax_t)sb->st_size,
+        (uintmax_t)sb->st_mtim.tv_sec, (unsigned long)sb->st_mtim.tv_nsec,
+        e ? "-" : "", e ? e->coding : "");
 
     dynstr_init(&b);
     dynstr_init(&d);
@@ -1093,6 +1112,17 @@ static int serve_file(struct http_response *const r,
         fprintf(stderr, "%s: fopen(3): %s\n", __func__, strerror(errno));
         goto end;
     }
+    else if (n < 0 || n >= sizeof etag)
+    {
+        fprintf(stderr, "%s: snprintf(3) failed\n", __func__);
+        goto end;
+    }
+    /* The copy might have been replaced since it was looked up. */
+    else if (e && fstat(fileno(f), &esb))
+    {
+        fprintf(stderr, "%s: fstat(2): %s\n", __func__, strerror(errno));
+        goto end;
+    }
     else if (dynstr_append(&b, "%s", res))
     {
         fprintf(stderr, "%s: dynstr_append res failed\n", __func__);
@@ -1121,7 +1151,7 @@ static int serve_file(struct http_response *const r,
     {
         .status = HTTP_STATUS_OK,
         .f = f,
-        .n = sb->st_size
+        .n = e ? esb.st_size : sb->st_size
     };
 
     if (http_response_add_header(r, "Content-Disposition", d.str))
@@ -1129,6 +1159,24 @@ static int serve_file(struct http_response *const r,
         fprintf(stderr, "%s: http_response_add_header failed\n", __func__);
         goto end;
     }
+    else if (e && http_response_add_header(r, "Content-Encoding", e->coding))
+    {
+        fprintf(stderr, "%s: http_response_add_header failed\n", __func__);
+        goto end;
+    }
+    /* Required by clients to resume downloads with If-Range. */
+    else if (http_date(sb->st_mtime, date, sizeof date))
+    {
+        fprintf(stderr, "%s: http_date failed\n", __func__);
+        goto end;
+    }
+    else if (http_response_add_header(r, "Last-Modified", date)
+        || http_response_add_header(r, "ETag", etag)
+        || http_response_add_header(r, "Cache-Control", cache))
+    {
+        fprintf(stderr, "%s: http_response_add_header failed\n", __func__);
+        goto end;
+    }
 
     ret = 0;
 
@@ -1184,6 +1232,109 @@ static bool preview(const struct page_resource *const pr)
     return false;
 }
 
+static bool same_time(const struct timespec *const a,
+    const struct timespec *const b)
+{
+    return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+/* Looks for a compressed copy of pr->res accepted by the client, which
+ * is only used if its modification time equals that of pr->res, so that
+ * it belongs to this version of pr->res. Returns zero if found, in which
+ * case its path is stored into d, or a positive value otherwise. */
+static int find_sidecar(const struct page_resource *const pr,
+    const struct stat *const sb, struct dynstr *const d,
+    const char **const coding)
+{
+    static const struct coding
+    {
+        unsigned encoding;
+        const char *coding, *ext;
+    } codings[] =
+    {
+        /* Preferred, since it decompresses faster. */
+        {.encoding = HTTP_ENCODING_ZSTD, .coding = "zstd", .ext = ".zst"},
+        {.encoding = HTTP_ENCODING_GZIP, .coding = "gzip", .ext = ".gz"}
+    };
+
+    if (!pr->sidecar)
+        return 1;
+
+    for (size_t i = 0; i < sizeof codings / sizeof *codings; i++)
+    {
+        const struct coding *const c = &codings[i];
+        struct stat csb;
+
+        if (!(pr->encodings & c->encoding))
+            continue;
+        else if (dynstr_append(d, "%s%s", pr->sidecar, c->ext))
+        {
+            fprintf(stderr, "%s: dynstr_append failed\n", __func__);
+            return -1;
+        }
+        else if (stat(d->str, &csb))
+        {
+            if (errno != ENOENT && errno != ENOTDIR)
+            {
+                fprintf(stderr, "%s: stat(2) %s: %s\n",
+                    __func__, d->str, strerror(errno));
+                return -1;
+            }
+        }
+        else if (S_ISREG(csb.st_mode)
+            && same_time(&csb.st_mtim, &sb->st_mtim))
+        {
+            *coding = c->coding;
+            return 0;
+        }
+
+        dynstr_free(d);
+    }
+
+    return 1;
+}
+
+static int resource_file(const struct page_resource *const pr,
+    const struct stat *const sb)
+{
+    int ret = -1;
+    struct dynstr d;
+    const char *coding;
+
+    dynstr_init(&d);
+
+    const int res = find_sidecar(pr, sb, &d, &coding);
+
+    if (res < 0)
+    {
+        fprintf(stderr, "%s: find_sidecar failed\n", __func__);
+        goto end;
+    }
+    else if (serve_file(pr->r, sb, pr->res, preview(pr), "private, no-cache",
+        res ? NULL : &(const struct encoded)
+        {
+            .path = d.str,
+            .coding = coding
+        }))
+    {
+        fprintf(stderr, "%s: serve_file failed\n", __func__);
+        goto end;
+    }
+    /* Caches must not send a compressed copy to other clients. */
+    else if (pr->sidecar
+        && http_response_add_header(pr->r, "Vary", "Accept-Encoding"))
+    {
+        fprintf(stderr, "%s: http_response_add_header failed\n", __func__);
+        goto end;
+    }
+
+    ret = 0;
+
+end:
+    dynstr_free(&d);
+    return ret;
+}
+
 int page_resource(const struct page_resource *const pr)
 {
     struct stat sb;
@@ -1204,7 +1355,7 @@ int page_resource(const struct page_resource *const pr)
     if (S_ISDIR(m))
         return list_dir(pr);
     else if (S_ISREG(m))
-        return serve_file(pr->r, &sb, pr->res, preview(pr));
+        return resource_file(pr, &sb);
 
     fprintf(stderr, "%s: unexpected st_mode %jd\n", __func__, (intmax_t)m);
     return -1;
@@ -1276,7 +1427,7 @@ int page_public(struct http_response *const r, const char *const res)
         fprintf(stderr, "%s: resolve_link failed\n", __func__);
         goto end;
     }
-    else if (serve_file(r, &sb, path, false))
+    else if (serve_file(r, &sb, path, false, "no-cache", NULL))
     {
         fprintf(stderr, "%s: serve_file failed\n", __func__);
         goto end;
@@ -1461,7 +1612,10 @@ int page_style(struct http_response *const r)
         .n = sizeof body - 1
     };
 
-    if (http_response_add_header(r, "Content-Type", "text/css"))
+    if (http_response_add_header(r, "Content-Type", "text/css")
+        /* Only changes along with the binary. */
+        || http_response_add_header(r, "Cache-Control",
+            "public, max-age=604800"))
     {
         fprintf(stderr, "%s: http_response_add_header failed\n", __func__);
         return -1;
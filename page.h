@@ -13,6 +13,10 @@ struct page_resource
 {
     struct http_response *r;
     const char *dir, *root, *res;
+    /* Path to compressed copies of res, without their extension. Copies
+     * are sent instead of res if accepted from encodings. Optional. */
+    const char *sidecar;
+    unsigned encodings;
     const struct page_quota *q;
     const struct http_arg *args;
     size_t n_args;
@@ -1,12 +1,19 @@
 #define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE /* SO_REUSEPORT is not defined by POSIX. */
+#define _GNU_SOURCE /* accept4(2) is not defined by POSIX. */
 
 #include "server.h"
 #include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <poll.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -14,19 +21,355 @@
 #include <stdlib.h>
 #include <string.h>
 
+/* epoll(7) keeps interest registrations across wakeups, so its cost
+ * depends on the number of ready connections rather than on the total
+ * number of connections. Define SLCL_POLL to force the portable poll(2)
+ * backend, or SLCL_IO_URING to select the io_uring(7) backend, which
+ * requires Linux 6.0 or later. */
+#if defined(SLCL_IO_URING)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <stdint.h>
+
+/* Provided buffers shared by all clients from a server. */
+enum {N_BUFS = 128, BUF_SZ = 16 * 1024};
+
+/* Writes from server_pwrite in flight per client, beyond which they are
+ * done in place, so that memory is bounded and clients sending faster
+ * than the disk can write are slowed down. */
+enum {MAX_WRITES = 8};
+#elif defined(__linux__) && !defined(SLCL_POLL)
+#define SLCL_EPOLL
+#include <sys/epoll.h>
+#endif
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
 struct server
 {
     int fd;
-
+    unsigned short port;
+    /* Only set for AF_UNIX sockets bound by server_init. */
+    char *path;
+    /* Set by server_stop_accept. */
+    bool stopped;
+
+    /* Clients are indexed by their file descriptor, so lookup, insertion
+     * and removal are constant-time operations. Released clients are
+     * recycled from a free list, so their addresses remain stable. */
     struct server_client
     {
         int fd;
-        bool write;
-    } *c;
+        bool write, blocked, suspended, queued;
+        size_t budget;
+        void *user;
+        struct server *s;
+        struct server_client *next;
+
+#ifdef SLCL_IO_URING
+        /* Received buffers are queued by their ID. */
+        int head, tail, error, werror;
+        /* Writes from server_pwrite in flight. */
+        size_t writes;
+        bool recv, pollin, pollout, eof, closed, deferred, sync;
+        struct server_client *dnext;
+#endif
+    } **c, **ready, *free;
+
+    size_t n, n_slots, n_ready, ready_sz;
+
+#if defined(SLCL_EPOLL)
+    int epfd;
+    struct epoll_event ev[64];
+#elif defined(SLCL_IO_URING)
+    struct uring
+    {
+        int fd;
+        void *ring;
+        size_t ring_sz, sqes_sz;
+        struct io_uring_sqe *sqes;
+        unsigned *sq_head, *sq_tail, *sq_mask, sq_entries, tail;
+        unsigned *cq_head, *cq_tail, *cq_mask;
+        struct io_uring_cqe *cqes;
+        struct io_uring_buf_ring *br;
+        unsigned short br_tail;
+        char *bufs;
+        size_t n_bufs;
+        /* Whether the multishot accept request is still active. */
+        bool accept;
+
+        struct rbuf
+        {
+            size_t len, off;
+            int next;
+        } rbufs[N_BUFS];
+
+        /* Clients to be looked at on the next wakeup, and closed clients
+         * waiting for their requests to be cancelled. */
+        struct server_client *deferred, *zombies;
+    } u;
+#endif
+};
+
+static volatile sig_atomic_t do_exit;
+/* Self-pipe shared by all servers, so that every event loop is woken up on
+ * exit, regardless of the thread the signal was delivered to. Its read end
+ * is never drained, so it remains readable once written. */
+static int exit_pipe[2] = {-1, -1};
+
+#ifdef SLCL_IO_URING
+/* Operations are stored into the lower bits of user_data, since clients
+ * are aligned to at least 8 bytes. */
+enum op
+{
+    OP_ACCEPT,
+    OP_EXIT,
+    OP_CANCEL,
+    OP_RECV,
+    OP_POLLIN,
+    OP_POLLOUT,
+    OP_PWRITE
+};
 
+enum {OP_MASK = 7};
+
+/* Writes from server_pwrite own a copy of their data, since callers might
+ * reuse their buffer as soon as server_pwrite returns. */
+struct pwrite_op
+{
+    struct server_client *c;
     size_t n;
+    char buf[];
 };
 
+static __u64 tag(const struct server_client *const c, const enum op op)
+{
+    return (uintptr_t)c | op;
+}
+
+/* poll32_events is word-reversed on big-endian hosts. */
+static __u32 poll_events(const __u32 events)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return events << 16 | events >> 16;
+#else
+    return events;
+#endif
+}
+
+static int uring_close(struct uring *const u)
+{
+    int ret = 0;
+
+    if (u->fd >= 0 && close(u->fd))
+    {
+        fprintf(stderr, "%s: close(2): %s\n", __func__, strerror(errno));
+        ret = -1;
+    }
+
+    if (u->ring && munmap(u->ring, u->ring_sz))
+    {
+        fprintf(stderr, "%s: munmap(2) ring: %s\n", __func__, strerror(errno));
+        ret = -1;
+    }
+
+    if (u->sqes && munmap(u->sqes, u->sqes_sz))
+    {
+        fprintf(stderr, "%s: munmap(2) sqes: %s\n", __func__, strerror(errno));
+        ret = -1;
+    }
+
+    free(u->br);
+    free(u->bufs);
+    return ret;
+}
+
+static unsigned pending_sqes(const struct uring *const u)
+{
+    return u->tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+}
+
+/* timeout is only used if waiting, and is given in milliseconds, with
+ * negative values blocking indefinitely. */
+static int uring_enter(struct uring *const u, const bool wait,
+    const int timeout)
+{
+    const struct __kernel_timespec ts =
+    {
+        .tv_sec = timeout / 1000,
+        .tv_nsec = timeout % 1000 * 1000000L
+    };
+
+    const struct io_uring_getevents_arg arg =
+    {
+        .ts = (uintptr_t)&ts
+    };
+
+    const bool ext = wait && timeout >= 0;
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+
+    if (ext)
+        flags |= IORING_ENTER_EXT_ARG;
+
+    __atomic_store_n(u->sq_tail, u->tail, __ATOMIC_RELEASE);
+
+    if (syscall(__NR_io_uring_enter, u->fd, pending_sqes(u), wait, flags,
+        ext ? &arg : NULL, ext ? sizeof arg : 0) < 0)
+        /* Expired timeouts are not errors. */
+        return errno == ETIME ? 0 : -1;
+
+    return 0;
+}
+
+static struct io_uring_sqe *get_sqe(struct uring *const u)
+{
+    if (pending_sqes(u) >= u->sq_entries)
+    {
+        if (uring_enter(u, false, -1))
+        {
+            fprintf(stderr, "%s: io_uring_enter(2): %s\n",
+                __func__, strerror(errno));
+            return NULL;
+        }
+        else if (pending_sqes(u) >= u->sq_entries)
+        {
+            fprintf(stderr, "%s: submission queue full\n", __func__);
+            return NULL;
+        }
+    }
+
+    struct io_uring_sqe *const sqe = &u->sqes[u->tail++ & *u->sq_mask];
+
+    *sqe = (const struct io_uring_sqe){0};
+    return sqe;
+}
+
+static void put_buf(struct uring *const u, const int bid)
+{
+    struct io_uring_buf *const b = &u->br->bufs[u->br_tail & (N_BUFS - 1)];
+
+    b->addr = (uintptr_t)&u->bufs[(size_t)bid * BUF_SZ];
+    b->len = BUF_SZ;
+    b->bid = bid;
+    __atomic_store_n(&u->br->tail, ++u->br_tail, __ATOMIC_RELEASE);
+    u->n_bufs++;
+}
+
+static int uring_init(struct uring *const u)
+{
+    enum {ENTRIES = 256};
+    /* Multishot requests can post several completions per submission. */
+    struct io_uring_params p =
+    {
+        .flags = IORING_SETUP_CQSIZE,
+        .cq_entries = ENTRIES * 4
+    };
+
+    if ((u->fd = syscall(__NR_io_uring_setup, ENTRIES, &p)) < 0)
+    {
+        fprintf(stderr, "%s: io_uring_setup(2): %s\n",
+            __func__, strerror(errno));
+        return -1;
+    }
+    else if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        fprintf(stderr, "%s: IORING_FEAT_SINGLE_MMAP not supported\n",
+            __func__);
+        return -1;
+    }
+
+    const size_t sq_sz = p.sq_off.array + p.sq_entries * sizeof (unsigned),
+        cq_sz = p.cq_off.cqes + p.cq_entries * sizeof *u->cqes;
+    void *ring;
+
+    u->ring_sz = sq_sz > cq_sz ? sq_sz : cq_sz;
+    u->sqes_sz = p.sq_entries * sizeof *u->sqes;
+
+    if ((ring = mmap(NULL, u->ring_sz, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING)) == MAP_FAILED)
+    {
+        fprintf(stderr, "%s: mmap(2) ring: %s\n", __func__, strerror(errno));
+        return -1;
+    }
+
+    u->ring = ring;
+
+    void *const sqes = mmap(NULL, u->sqes_sz, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+
+    if (sqes == MAP_FAILED)
+    {
+        fprintf(stderr, "%s: mmap(2) sqes: %s\n", __func__, strerror(errno));
+        return -1;
+    }
+
+    char *const r = ring;
+    unsigned *const array = (unsigned *)(r + p.sq_off.array);
+
+    u->sqes = sqes;
+    u->sq_head = (unsigned *)(r + p.sq_off.head);
+    u->sq_tail = (unsigned *)(r + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(r + p.sq_off.ring_mask);
+    u->sq_entries = p.sq_entries;
+    u->tail = *u->sq_tail;
+    u->cq_head = (unsigned *)(r + p.cq_off.head);
+    u->cq_tail = (unsigned *)(r + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(r + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(r + p.cq_off.cqes);
+
+    for (unsigned i = 0; i < p.sq_entries; i++)
+        array[i] = i;
+
+    const long pagesz = sysconf(_SC_PAGESIZE);
+    const size_t br_sz = N_BUFS * sizeof *u->br->bufs;
+    void *br;
+    int error;
+
+    if (pagesz < 0)
+    {
+        fprintf(stderr, "%s: sysconf(3): %s\n", __func__, strerror(errno));
+        return -1;
+    }
+    else if ((error = posix_memalign(&br, pagesz, br_sz)))
+    {
+        fprintf(stderr, "%s: posix_memalign(3): %s\n",
+            __func__, strerror(error));
+        return -1;
+    }
+
+    u->br = memset(br, 0, br_sz);
+
+    if (!(u->bufs = malloc((size_t)N_BUFS * BUF_SZ)))
+    {
+        fprintf(stderr, "%s: malloc(3): %s\n", __func__, strerror(errno));
+        return -1;
+    }
+
+    const struct io_uring_buf_reg reg =
+    {
+        .ring_addr = (uintptr_t)u->br,
+        .ring_entries = N_BUFS
+    };
+
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING,
+        &reg, 1))
+    {
+        fprintf(stderr, "%s: io_uring_register(2): %s\n",
+            __func__, strerror(errno));
+        return -1;
+    }
+
+    for (int i = 0; i < N_BUFS; i++)
+        put_buf(u, i);
+
+    return 0;
+}
+
+#endif
+
 int server_close(struct server *const s)
 {
     int ret = 0;
@@ -36,181 +379,1339 @@ int server_close(struct server *const s)
     else if (s->fd >= 0)
         ret = close(s->fd);
 
+    if (s->path && unlink(s->path))
+    {
+        fprintf(stderr, "%s: unlink(2) %s: %s\n",
+            __func__, s->path, strerror(errno));
+        ret = -1;
+    }
+
+#if defined(SLCL_EPOLL)
+    if (s->epfd >= 0 && close(s->epfd))
+    {
+        fprintf(stderr, "%s: close(2) epfd: %s\n", __func__, strerror(errno));
+        ret = -1;
+    }
+#elif defined(SLCL_IO_URING)
+    if (uring_close(&s->u))
+        ret = -1;
+
+    for (struct server_client *c = s->u.zombies; c;)
+    {
+        struct server_client *const next = c->next;
+
+        free(c);
+        c = next;
+    }
+#endif
+
+    for (size_t i = 0; i < s->n_slots; i++)
+        free(s->c[i]);
+
+    for (struct server_client *c = s->free; c;)
+    {
+        struct server_client *const next = c->next;
+
+        free(c);
+        c = next;
+    }
+
+    free(s->path);
+    free(s->c);
+    free(s->ready);
     free(s);
     return ret;
 }
 
-int server_client_close(struct server *const s, struct server_client *const c)
+#if defined(SLCL_EPOLL)
+static int epoll_events(const struct server_client *const c)
 {
-    int ret = 0;
+    return c->write ? EPOLLIN | EPOLLOUT : EPOLLIN;
+}
 
-    for (size_t i = 0; i < s->n; i++)
+static int backend_add(struct server *const s, struct server_client *const c)
+{
+    struct epoll_event ev =
     {
-        struct server_client *const ref = &s->c[i];
+        .events = epoll_events(c),
+        .data.ptr = c
+    };
 
-        if (c == ref)
-        {
-            const size_t n = s->n - 1;
+    if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, c->fd, &ev))
+    {
+        fprintf(stderr, "%s: epoll_ctl(2): %s\n", __func__, strerror(errno));
+        return -1;
+    }
 
-            if ((ret = close(c->fd)))
-            {
-                fprintf(stderr, "%s: close(2): %s\n",
-                    __func__, strerror(errno));
-                return -1;
-            }
-            else if (n)
-            {
-                memcpy(ref, ref + 1, (s->n - i - 1) * sizeof *ref);
+    return 0;
+}
 
-                struct server_client *const c = realloc(s->c, n * sizeof *s->c);
+static int backend_mod(struct server *const s, struct server_client *const c)
+{
+    struct epoll_event ev =
+    {
+        .events = epoll_events(c),
+        .data.ptr = c
+    };
 
-                if (!c)
-                {
-                    fprintf(stderr, "%s: realloc(3): %s\n",
-                        __func__, strerror(errno));
-                    return -1;
-                }
+    if (epoll_ctl(s->epfd, EPOLL_CTL_MOD, c->fd, &ev))
+    {
+        fprintf(stderr, "%s: epoll_ctl(2): %s\n", __func__, strerror(errno));
+        return -1;
+    }
 
-                s->c = c;
-            }
-            else
-            {
-                free(s->c);
-                s->c = NULL;
-            }
+    return 0;
+}
 
-            s->n = n;
-            break;
-        }
+static int backend_del(struct server *const s, struct server_client *const c)
+{
+    if (epoll_ctl(s->epfd, EPOLL_CTL_DEL, c->fd, NULL))
+    {
+        fprintf(stderr, "%s: epoll_ctl(2): %s\n", __func__, strerror(errno));
+        return -1;
     }
 
-    return ret;
+    return 0;
 }
 
-int server_read(void *const buf, const size_t n, struct server_client *const c)
+static int backend_init(struct server *const s)
 {
-    const ssize_t r = read(c->fd, buf, n);
+    if ((s->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    {
+        fprintf(stderr, "%s: epoll_create1(2): %s\n",
+            __func__, strerror(errno));
+        return -1;
+    }
 
-    if (r < 0)
-        fprintf(stderr, "%s: read(2): %s\n", __func__, strerror(errno));
+    struct epoll_event ev =
+    {
+        .events = EPOLLIN,
+        /* NULL is reserved for the listening socket. */
+        .data.ptr = NULL
+    };
 
-    return r;
+    if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->fd, &ev))
+    {
+        fprintf(stderr, "%s: epoll_ctl(2): %s\n", __func__, strerror(errno));
+        return -1;
+    }
+
+    ev.data.ptr = exit_pipe;
+
+    if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, *exit_pipe, &ev))
+    {
+        fprintf(stderr, "%s: epoll_ctl(2) exit_pipe: %s\n",
+            __func__, strerror(errno));
+        return -1;
+    }
+
+    return 0;
 }
 
-int server_write(const void *const buf, const size_t n,
-    struct server_client *const c)
+static int backend_stop(struct server *const s)
 {
-    const ssize_t w = write(c->fd, buf, n);
+    if (epoll_ctl(s->epfd, EPOLL_CTL_DEL, s->fd, NULL))
+    {
+        fprintf(stderr, "%s: epoll_ctl(2): %s\n", __func__, strerror(errno));
+        return -1;
+    }
 
-    if (w < 0)
-        fprintf(stderr, "%s: write(2): %s\n", __func__, strerror(errno));
+    return 0;
+}
+#elif defined(SLCL_IO_URING)
+/* Requests for c are submitted on the next wakeup. */
+static void defer(struct server *const s, struct server_client *const c)
+{
+    if (!c->deferred)
+    {
+        c->deferred = true;
+        c->dnext = s->u.deferred;
+        s->u.deferred = c;
+    }
+}
 
-    return w;
+static int arm_recv(struct server *const s, struct server_client *const c)
+{
+    struct io_uring_sqe *const sqe = get_sqe(&s->u);
+
+    if (!sqe)
+    {
+        fprintf(stderr, "%s: get_sqe failed\n", __func__);
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->user_data = tag(c, OP_RECV);
+    c->recv = true;
+    return 0;
 }
 
-static struct server_client *alloc_client(struct server *const s)
+static int arm_poll(struct server *const s, const int fd, const __u32 events,
+    const __u64 user_data)
 {
-    struct sockaddr_in addr;
-    socklen_t sz = sizeof addr;
-    const int fd = accept(s->fd, (struct sockaddr *)&addr, &sz);
+    struct io_uring_sqe *const sqe = get_sqe(&s->u);
 
-    if (fd < 0)
+    if (!sqe)
     {
-        fprintf(stderr, "%s: accept(2): %s\n",
-            __func__, strerror(errno));
-        return NULL;
+        fprintf(stderr, "%s: get_sqe failed\n", __func__);
+        return -1;
     }
 
-    const int flags = fcntl(fd, F_GETFL);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = poll_events(events);
+    sqe->user_data = user_data;
+    return 0;
+}
 
-    if (flags < 0)
+static int arm_accept(struct server *const s)
+{
+    struct io_uring_sqe *const sqe = get_sqe(&s->u);
+
+    if (!sqe)
     {
-        fprintf(stderr, "%s: fcntl(2) F_GETFL: %s\n",
-            __func__, strerror(errno));
-        return NULL;
+        fprintf(stderr, "%s: get_sqe failed\n", __func__);
+        return -1;
     }
-    else if (fcntl(fd, F_SETFL, flags | O_NONBLOCK))
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = s->fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = tag(NULL, OP_ACCEPT);
+    s->u.accept = true;
+    return 0;
+}
+
+static int cancel(struct server *const s, const __u64 user_data)
+{
+    struct io_uring_sqe *const sqe = get_sqe(&s->u);
+
+    if (!sqe)
     {
-        fprintf(stderr, "%s: fcntl(2) F_SETFL: %s\n",
-            __func__, strerror(errno));
-        return NULL;
+        fprintf(stderr, "%s: get_sqe failed\n", __func__);
+        return -1;
     }
 
-    const size_t n = s->n + 1;
-    struct server_client *const clients = realloc(s->c, n * sizeof *s->c);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = user_data;
+    sqe->user_data = tag(NULL, OP_CANCEL);
+    return 0;
+}
+
+static int backend_add(struct server *const s, struct server_client *const c)
+{
+    defer(s, c);
+    return 0;
+}
+
+static int backend_mod(struct server *const s, struct server_client *const c)
+{
+    if (c->write)
+        defer(s, c);
+
+    return 0;
+}
+
+static int backend_del(struct server *const s, struct server_client *const c)
+{
+    /* Received data is still queued while suspended. */
+    return 0;
+}
 
-    if (!clients)
+static int backend_init(struct server *const s)
+{
+    if (uring_init(&s->u))
+    {
+        fprintf(stderr, "%s: uring_init failed\n", __func__);
+        return -1;
+    }
+    else if (arm_accept(s))
+    {
+        fprintf(stderr, "%s: arm_accept failed\n", __func__);
+        return -1;
+    }
+    else if (arm_poll(s, *exit_pipe, POLLIN, tag(NULL, OP_EXIT)))
+    {
+        fprintf(stderr, "%s: arm_poll failed\n", __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int backend_stop(struct server *const s)
+{
+    return cancel(s, tag(NULL, OP_ACCEPT));
+}
+
+/* Copies data already received by the kernel, so no system calls are
+ * required. Clients are read directly if no receive is armed, which
+ * happens when provided buffers were exhausted. */
+static ssize_t backend_read(struct server_client *const c, void *const buf,
+    const size_t n)
+{
+    struct uring *const u = &c->s->u;
+    char *const p = buf;
+    size_t r = 0;
+
+    while (r < n && c->head >= 0)
+    {
+        const int bid = c->head;
+        struct rbuf *const b = &u->rbufs[bid];
+        const size_t rem = b->len - b->off, cn = n - r < rem ? n - r : rem;
+
+        memcpy(&p[r], &u->bufs[(size_t)bid * BUF_SZ + b->off], cn);
+        b->off += cn;
+        r += cn;
+
+        if (b->off >= b->len)
+        {
+            if ((c->head = b->next) < 0)
+                c->tail = -1;
+
+            put_buf(u, bid);
+        }
+    }
+
+    if (r)
+        return r;
+    else if (c->error)
+    {
+        errno = c->error;
+        return -1;
+    }
+    else if (c->eof)
+        return 0;
+    /* Data could be reordered otherwise. */
+    else if (!c->recv)
+        return read(c->fd, buf, n);
+
+    errno = EAGAIN;
+    return -1;
+}
+
+/* Returns whether c can be recycled, which is not possible until pending
+ * requests are cancelled. */
+static bool backend_release(struct server *const s,
+    struct server_client *const c)
+{
+    struct uring *const u = &s->u;
+
+    while (c->head >= 0)
+    {
+        const int bid = c->head;
+
+        c->head = u->rbufs[bid].next;
+        put_buf(u, bid);
+    }
+
+    c->tail = -1;
+    c->closed = true;
+
+    if (c->recv && cancel(s, tag(c, OP_RECV)))
+        fprintf(stderr, "%s: cancel recv failed\n", __func__);
+
+    if (c->pollin && cancel(s, tag(c, OP_POLLIN)))
+        fprintf(stderr, "%s: cancel pollin failed\n", __func__);
+
+    if (c->pollout && cancel(s, tag(c, OP_POLLOUT)))
+        fprintf(stderr, "%s: cancel pollout failed\n", __func__);
+
+    if (c->recv || c->pollin || c->pollout || c->writes)
+    {
+        c->next = u->zombies;
+        u->zombies = c;
+        return false;
+    }
+
+    return true;
+}
+#else
+static int backend_add(struct server *const s, struct server_client *const c)
+{
+    return 0;
+}
+
+static int backend_mod(struct server *const s, struct server_client *const c)
+{
+    return 0;
+}
+
+static int backend_del(struct server *const s, struct server_client *const c)
+{
+    return 0;
+}
+
+static int backend_init(struct server *const s)
+{
+    return 0;
+}
+
+static int backend_stop(struct server *const s)
+{
+    return 0;
+}
+#endif
+
+#ifndef SLCL_IO_URING
+static ssize_t backend_read(struct server_client *const c, void *const buf,
+    const size_t n)
+{
+    return read(c->fd, buf, n);
+}
+
+static bool backend_release(struct server *const s,
+    struct server_client *const c)
+{
+    return true;
+}
+#endif
+
+static void recycle(struct server *const s, struct server_client *const c)
+{
+    c->next = s->free;
+    s->free = c;
+}
+
+int server_client_close(struct server *const s, struct server_client *const c)
+{
+    if (close(c->fd))
+    {
+        fprintf(stderr, "%s: close(2): %s\n", __func__, strerror(errno));
+        return -1;
+    }
+
+    /* Clients might be closed while the ready set returned by
+     * server_poll is being processed. */
+    for (size_t i = 0; i < s->n_ready; i++)
+        if (s->ready[i] == c)
+            s->ready[i] = NULL;
+
+    s->c[c->fd] = NULL;
+    s->n--;
+
+    if (backend_release(s, c))
+        recycle(s, c);
+
+    return 0;
+}
+
+void server_client_set_user(struct server_client *const c, void *const user)
+{
+    c->user = user;
+}
+
+void *server_client_user(const struct server_client *const c)
+{
+    return c->user;
+}
+
+static void update_budget(struct server_client *const c, const ssize_t r)
+{
+    if (r < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            c->blocked = true;
+    }
+    else if (r >= c->budget)
+        c->budget = 0;
+    else
+        c->budget -= r;
+}
+
+int server_read(void *const buf, const size_t n, struct server_client *const c)
+{
+    const ssize_t r = backend_read(c, buf, n);
+
+    update_budget(c, r);
+
+    if (r < 0 && !c->blocked)
+        fprintf(stderr, "%s: read(2): %s\n", __func__, strerror(errno));
+
+    return r;
+}
+
+int server_write(const void *const buf, const size_t n,
+    struct server_client *const c)
+{
+    const ssize_t w = write(c->fd, buf, n);
+
+    update_budget(c, w);
+
+    if (w < 0 && !c->blocked)
+        fprintf(stderr, "%s: write(2): %s\n", __func__, strerror(errno));
+
+    return w;
+}
+
+int server_writev(const struct iovec *const iov, const int n,
+    struct server_client *const c)
+{
+    const ssize_t w = writev(c->fd, iov, n);
+
+    update_budget(c, w);
+
+    if (w < 0 && !c->blocked)
+        fprintf(stderr, "%s: writev(2): %s\n", __func__, strerror(errno));
+
+    return w;
+}
+
+int server_sendfile(const int fd, off_t *const off, const size_t n,
+    struct server_client *const c)
+{
+#ifdef __linux__
+    /* A single call must not exceed the budget, or other clients would
+     * have to wait for the whole transfer. */
+    const ssize_t r = sendfile(c->fd, fd, off, n > c->budget ? c->budget : n);
+
+    update_budget(c, r);
+
+    /* EINVAL is returned for files that cannot be sent this way, which
+     * callers are expected to handle by other means. */
+    if (r < 0 && !c->blocked && errno != EINVAL)
+        fprintf(stderr, "%s: sendfile(2): %s\n", __func__, strerror(errno));
+
+    return r;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static int pwrite_all(const int fd, const void *const buf, const size_t n,
+    const off_t off)
+{
+    for (size_t w = 0; w < n;)
+    {
+        const ssize_t r = pwrite(fd, (const char *)buf + w, n - w, off + w);
+
+        if (r < 0)
+        {
+            fprintf(stderr, "%s: pwrite(2): %s\n", __func__, strerror(errno));
+            return -1;
+        }
+
+        w += r;
+    }
+
+    return 0;
+}
+
+#ifdef SLCL_IO_URING
+int server_pwrite(const int fd, const void *const buf, const size_t n,
+    const off_t off, struct server_client *const c)
+{
+    struct uring *const u = &c->s->u;
+    struct pwrite_op *w;
+    struct io_uring_sqe *sqe;
+
+    if (c->writes >= MAX_WRITES || n > UINT32_MAX)
+        return pwrite_all(fd, buf, n, off);
+    else if (!(w = malloc(sizeof *w + n)))
+    {
+        fprintf(stderr, "%s: malloc(3): %s\n", __func__, strerror(errno));
+        return -1;
+    }
+    else if (!(sqe = get_sqe(u)))
+    {
+        fprintf(stderr, "%s: get_sqe failed\n", __func__);
+        free(w);
+        return -1;
+    }
+
+    w->c = c;
+    w->n = n;
+    memcpy(w->buf, buf, n);
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)w->buf;
+    sqe->len = n;
+    sqe->off = off;
+    sqe->user_data = (uintptr_t)w | OP_PWRITE;
+    c->writes++;
+
+    /* Submitted right away, since callers might close fd as soon as this
+     * returns, and its number could then be reused by another file. */
+    if (uring_enter(u, false, -1))
+    {
+        fprintf(stderr, "%s: io_uring_enter(2): %s\n",
+            __func__, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+int server_client_sync(struct server_client *const c)
+{
+    if (c->writes)
+    {
+        c->sync = true;
+        server_client_suspend(c, true);
+        return 1;
+    }
+    else if (c->werror)
+    {
+        fprintf(stderr, "%s: write: %s\n", __func__, strerror(c->werror));
+        c->werror = 0;
+        return -1;
+    }
+
+    return 0;
+}
+#else
+int server_pwrite(const int fd, const void *const buf, const size_t n,
+    const off_t off, struct server_client *const c)
+{
+    return pwrite_all(fd, buf, n, off);
+}
+
+int server_client_sync(struct server_client *const c)
+{
+    return 0;
+}
+#endif
+
+bool server_client_ready(const struct server_client *const c)
+{
+    return !c->suspended && !c->blocked && c->budget;
+}
+
+static int add_ready(struct server *const s, struct server_client *const c)
+{
+    if (c->queued)
+        return 0;
+    else if (s->n_ready >= s->ready_sz)
+    {
+        const size_t n = s->ready_sz ? s->ready_sz * 2 : 16;
+        struct server_client **const ready = realloc(s->ready,
+            n * sizeof *s->ready);
+
+        if (!ready)
+        {
+            fprintf(stderr, "%s: realloc(3): %s\n", __func__, strerror(errno));
+            return -1;
+        }
+
+        s->ready = ready;
+        s->ready_sz = n;
+    }
+
+    /* Maximum number of bytes transferred per wakeup, so that a single
+     * busy connection cannot starve the rest. */
+    enum {BUDGET = 128 * 1024};
+
+    c->blocked = false;
+    c->budget = BUDGET;
+    c->queued = true;
+    s->ready[s->n_ready++] = c;
+    return 0;
+}
+
+#ifndef SLCL_IO_URING
+/* Clients from the previous wakeup that did not block, either because
+ * they ran out of budget or were suspended, might still have data
+ * buffered by their users, which poll(2) and epoll(7) do not know about.
+ * Therefore, they are looked at again, and *busy is set if any of them
+ * can be serviced right away. The ready set is overwritten in place,
+ * which is safe since it cannot grow beyond its previous size. */
+static int carry_over(struct server *const s, bool *const busy)
+{
+    const size_t n = s->n_ready;
+
+    *busy = false;
+    s->n_ready = 0;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        struct server_client *const c = s->ready[i];
+
+        if (!c || c->blocked)
+            continue;
+        else if (add_ready(s, c))
+        {
+            fprintf(stderr, "%s: add_ready failed\n", __func__);
+            return -1;
+        }
+        else if (!c->suspended)
+            *busy = true;
+    }
+
+    return 0;
+}
+#endif
+
+static int set_nonblock(const int fd)
+{
+    const int flags = fcntl(fd, F_GETFL);
+
+    if (flags < 0)
+    {
+        fprintf(stderr, "%s: fcntl(2) F_GETFL: %s\n",
+            __func__, strerror(errno));
+        return -1;
+    }
+    else if (fcntl(fd, F_SETFL, flags | O_NONBLOCK))
+    {
+        fprintf(stderr, "%s: fcntl(2) F_SETFL: %s\n",
+            __func__, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* fd must be non-blocking. */
+static struct server_client *alloc_client(struct server *const s,
+    const int fd)
+{
+    struct server_client *c = NULL;
+
+    if (fd >= s->n_slots)
+    {
+        const size_t n = fd >= s->n_slots * 2 ? fd + 1 : s->n_slots * 2;
+        struct server_client **const slots = realloc(s->c, n * sizeof *s->c);
+
+        if (!slots)
+        {
+            fprintf(stderr, "%s: realloc(3): %s\n", __func__, strerror(errno));
+            goto failure;
+        }
+
+        for (size_t i = s->n_slots; i < n; i++)
+            slots[i] = NULL;
+
+        s->c = slots;
+        s->n_slots = n;
+    }
+
+    if (s->free)
+    {
+        c = s->free;
+        s->free = c->next;
+    }
+    else if (!(c = malloc(sizeof *c)))
+    {
+        fprintf(stderr, "%s: malloc(3): %s\n", __func__, strerror(errno));
+        goto failure;
+    }
+
+    *c = (const struct server_client)
+    {
+        .fd = fd,
+        .s = s,
+#ifdef SLCL_IO_URING
+        .head = -1,
+        .tail = -1
+#endif
+    };
+
+    s->c[fd] = c;
+    s->n++;
+
+    if (backend_add(s, c))
+    {
+        fprintf(stderr, "%s: backend_add failed\n", __func__);
+        server_client_close(s, c);
+        return NULL;
+    }
+    /* Requests are usually sent along with the connection, so new
+     * clients are serviced on the same wakeup. */
+    else if (add_ready(s, c))
+    {
+        fprintf(stderr, "%s: add_ready failed\n", __func__);
+        server_client_close(s, c);
+        return NULL;
+    }
+
+    return c;
+
+failure:
+    free(c);
+
+    if (close(fd))
+        fprintf(stderr, "%s: close(2): %s\n", __func__, strerror(errno));
+
+    return NULL;
+}
+
+struct server_client *server_client_add(struct server *const s, const int fd)
+{
+    if (set_nonblock(fd))
+    {
+        fprintf(stderr, "%s: set_nonblock failed\n", __func__);
+
+        if (close(fd))
+            fprintf(stderr, "%s: close(2): %s\n", __func__, strerror(errno));
+
+        return NULL;
+    }
+
+    return alloc_client(s, fd);
+}
+
+#ifndef SLCL_IO_URING
+/* accept4(2) saves two fcntl(2) calls per connection, where available. */
+static int accept_nonblock(const int fd)
+{
+#if defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC)
+    return accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    return accept(fd, NULL, NULL);
+#endif
+}
+
+static int accept_clients(struct server *const s)
+{
+    for (;;)
+    {
+        const int fd = accept_nonblock(s->fd);
+
+        if (fd < 0)
+        {
+            switch (errno)
+            {
+                case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+                case EWOULDBLOCK:
+#endif
+                    return 0;
+
+                case ECONNABORTED:
+                    /* Fall through. */
+                case EINTR:
+                    continue;
+
+                default:
+                    fprintf(stderr, "%s: accept(2): %s\n",
+                        __func__, strerror(errno));
+                    return -1;
+            }
+        }
+#if !defined(SOCK_NONBLOCK) || !defined(SOCK_CLOEXEC)
+        else if (set_nonblock(fd))
+        {
+            fprintf(stderr, "%s: set_nonblock failed\n", __func__);
+
+            if (close(fd))
+                fprintf(stderr, "%s: close(2): %s\n",
+                    __func__, strerror(errno));
+
+            return -1;
+        }
+#endif
+        else if (!alloc_client(s, fd))
+        {
+            fprintf(stderr, "%s: alloc_client failed\n", __func__);
+            return -1;
+        }
+    }
+}
+#endif
+
+void server_client_write_pending(struct server_client *const c,
+    const bool write)
+{
+    if (c->write != write)
+    {
+        c->write = write;
+
+        /* Suspended clients are registered again on resume. */
+        if (!c->suspended && backend_mod(c->s, c))
+            fprintf(stderr, "%s: backend_mod failed\n", __func__);
+    }
+}
+
+void server_client_suspend(struct server_client *const c, const bool suspend)
+{
+    if (c->suspended != suspend)
+    {
+        c->suspended = suspend;
+
+        if (suspend)
+        {
+            if (backend_del(c->s, c))
+                fprintf(stderr, "%s: backend_del failed\n", __func__);
+        }
+        else if (backend_add(c->s, c))
+            fprintf(stderr, "%s: backend_add failed\n", __func__);
+    }
+}
+
+int server_stop_accept(struct server *const s)
+{
+    if (s->stopped)
+        return 0;
+    else if (backend_stop(s))
+    {
+        fprintf(stderr, "%s: backend_stop failed\n", __func__);
+        return -1;
+    }
+
+    /* The listening socket might still be used by another process, so it
+     * must not be removed on exit. */
+    free(s->path);
+    s->path = NULL;
+    s->stopped = true;
+    return 0;
+}
+
+bool server_accepting(const struct server *const s)
+{
+#ifdef SLCL_IO_URING
+    return s->u.accept;
+#else
+    return !s->stopped;
+#endif
+}
+
+void server_shutdown(void)
+{
+    const int error = errno;
+
+    do_exit = 1;
+
+    if (exit_pipe[1] >= 0)
+        (void)write(exit_pipe[1], "", 1);
+
+    errno = error;
+}
+
+static void handle_signal(const int signum)
+{
+    switch (signum)
+    {
+        case SIGINT:
+            /* Fall through. */
+        case SIGTERM:
+            server_shutdown();
+            break;
+
+        default:
+            break;
+    }
+}
+
+#if defined(SLCL_EPOLL)
+static int backend_wait(struct server *const s, const int timeout,
+    bool *const exit)
+{
+    int res;
+    bool busy;
+
+    if (carry_over(s, &busy))
+    {
+        fprintf(stderr, "%s: carry_over failed\n", __func__);
+        return -1;
+    }
+
+again:
+
+    res = epoll_wait(s->epfd, s->ev, sizeof s->ev / sizeof *s->ev,
+        busy ? 0 : timeout);
+
+    if (res < 0)
+    {
+        if (do_exit)
+        {
+            *exit = true;
+            return 0;
+        }
+
+        switch (errno)
+        {
+            case EAGAIN:
+                /* Fall through. */
+            case EINTR:
+                goto again;
+
+            default:
+                fprintf(stderr, "%s: epoll_wait(2): %s\n",
+                    __func__, strerror(errno));
+                return -1;
+        }
+    }
+
+    for (int i = 0; i < res; i++)
+    {
+        const struct epoll_event *const ev = &s->ev[i];
+
+        if (ev->data.ptr == exit_pipe)
+        {
+            *exit = true;
+            return 0;
+        }
+        else if (!ev->data.ptr)
+        {
+            if (accept_clients(s))
+            {
+                fprintf(stderr, "%s: accept_clients failed\n", __func__);
+                return -1;
+            }
+        }
+        else if (add_ready(s, ev->data.ptr))
+        {
+            fprintf(stderr, "%s: add_ready failed\n", __func__);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+#elif defined(SLCL_IO_URING)
+static int prepare(struct server *const s, struct server_client *const c)
+{
+    if (c->closed || c->suspended)
+        return 0;
+    else if (!c->recv && !c->pollin && !c->eof && !c->error)
+    {
+        /* Buffers are held by clients that have not consumed their data
+         * yet, so c is polled and read directly meanwhile. */
+        if (!s->u.n_bufs)
+        {
+            if (arm_poll(s, c->fd, POLLIN, tag(c, OP_POLLIN)))
+            {
+                fprintf(stderr, "%s: arm_poll failed\n", __func__);
+                return -1;
+            }
+
+            c->pollin = true;
+        }
+        else if (arm_recv(s, c))
+        {
+            fprintf(stderr, "%s: arm_recv failed\n", __func__);
+            return -1;
+        }
+    }
+
+    if (c->write && c->blocked)
+    {
+        if (!c->pollout)
+        {
+            if (arm_poll(s, c->fd, POLLOUT, tag(c, OP_POLLOUT)))
+            {
+                fprintf(stderr, "%s: arm_poll failed\n", __func__);
+                return -1;
+            }
+
+            c->pollout = true;
+        }
+    }
+    else if ((!c->blocked || c->head >= 0 || c->eof || c->error)
+        && add_ready(s, c))
+    {
+        fprintf(stderr, "%s: add_ready failed\n", __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int process_client(struct server *const s,
+    struct server_client *const c)
+{
+    struct uring *const u = &s->u;
+
+    if (c->closed)
+    {
+        if (!c->recv && !c->pollin && !c->pollout && !c->writes)
+        {
+            for (struct server_client **z = &u->zombies; *z; z = &(*z)->next)
+                if (*z == c)
+                {
+                    *z = c->next;
+                    break;
+                }
+
+            recycle(s, c);
+        }
+
+        return 0;
+    }
+    else if (c->suspended)
+        return 0;
+
+    return add_ready(s, c);
+}
+
+static void recv_data(struct uring *const u, struct server_client *const c,
+    const int bid, const size_t len)
+{
+    struct rbuf *const b = &u->rbufs[bid];
+
+    *b = (const struct rbuf)
+    {
+        .len = len,
+        .next = -1
+    };
+
+    if (c->tail >= 0)
+        u->rbufs[c->tail].next = bid;
+    else
+        c->head = bid;
+
+    c->tail = bid;
+}
+
+static int process_recv(struct server *const s, struct server_client *const c,
+    const struct io_uring_cqe *const cqe)
+{
+    struct uring *const u = &s->u;
+
+    if (cqe->flags & IORING_CQE_F_BUFFER)
+    {
+        const int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+        u->n_bufs--;
+
+        if (c->closed || cqe->res <= 0)
+            put_buf(u, bid);
+        else
+            recv_data(u, c, bid, cqe->res);
+    }
+
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+    {
+        c->recv = false;
+
+        if (!cqe->res)
+            c->eof = true;
+        else if (!c->closed && (cqe->res > 0 || cqe->res == -ENOBUFS))
+            defer(s, c);
+        else if (cqe->res != -ECANCELED)
+            c->error = -cqe->res;
+    }
+
+    return process_client(s, c);
+}
+
+static int process_pwrite(struct server *const s,
+    struct pwrite_op *const w, const struct io_uring_cqe *const cqe)
+{
+    struct server_client *const c = w->c;
+
+    /* Regular files only return short writes on errors such as ENOSPC.
+     * They are not retried, since the file descriptor might have been
+     * closed already. */
+    if (cqe->res < 0)
+        c->werror = -cqe->res;
+    else if (cqe->res != w->n)
+        c->werror = ENOSPC;
+
+    free(w);
+
+    if (!--c->writes && c->sync)
+    {
+        c->sync = false;
+        server_client_suspend(c, false);
+    }
+
+    return process_client(s, c);
+}
+
+static int process_accept(struct server *const s,
+    const struct io_uring_cqe *const cqe)
+{
+    const int res = cqe->res;
+
+    if (res >= 0)
+    {
+        if (!alloc_client(s, res))
+        {
+            fprintf(stderr, "%s: alloc_client failed\n", __func__);
+            return -1;
+        }
+    }
+    else if (res != -ECONNABORTED && res != -EINTR
+        && !(res == -ECANCELED && s->stopped))
+    {
+        fprintf(stderr, "%s: accept: %s\n", __func__, strerror(-res));
+        return -1;
+    }
+
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+    {
+        s->u.accept = false;
+
+        if (!s->stopped && arm_accept(s))
+        {
+            fprintf(stderr, "%s: arm_accept failed\n", __func__);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int process_cqe(struct server *const s,
+    const struct io_uring_cqe *const cqe, bool *const exit)
+{
+    struct server_client *const c =
+        (struct server_client *)(uintptr_t)(cqe->user_data & ~(__u64)OP_MASK);
+
+    switch (cqe->user_data & OP_MASK)
+    {
+        case OP_ACCEPT:
+            return process_accept(s, cqe);
+
+        case OP_EXIT:
+            *exit = true;
+            return 0;
+
+        case OP_CANCEL:
+            return 0;
+
+        case OP_RECV:
+            return process_recv(s, c, cqe);
+
+        case OP_POLLIN:
+            c->pollin = false;
+            return process_client(s, c);
+
+        case OP_POLLOUT:
+            c->pollout = false;
+            return process_client(s, c);
+
+        case OP_PWRITE:
+            return process_pwrite(s, (struct pwrite_op *)c, cqe);
+    }
+
+    fprintf(stderr, "%s: unexpected user_data %#llx\n",
+        __func__, (unsigned long long)cqe->user_data);
+    return -1;
+}
+
+static int backend_wait(struct server *const s, const int timeout,
+    bool *const exit)
+{
+    int ret = -1;
+    struct uring *const u = &s->u;
+    struct server_client *d = u->deferred;
+    const size_t n = s->n_ready;
+
+    /* Completions are not posted for data already received or for
+     * clients that ran out of budget, so clients from the previous
+     * wakeup are looked at again. The ready set is overwritten in place,
+     * which is safe since it cannot grow beyond its previous size. */
+    s->n_ready = 0;
+    u->deferred = NULL;
+
+    for (size_t i = 0; i < n; i++)
     {
-        fprintf(stderr, "%s: realloc(3): %s\n", __func__, strerror(errno));
-        return NULL;
-    }
+        struct server_client *const c = s->ready[i];
 
-    struct server_client *const c = &clients[s->n];
+        if (c && prepare(s, c))
+        {
+            fprintf(stderr, "%s: prepare failed\n", __func__);
+            return -1;
+        }
+    }
 
-    *c = (const struct server_client)
+    while (d)
     {
-        .fd = fd
-    };
+        struct server_client *const next = d->dnext;
 
-    s->c = clients;
-    s->n = n;
-    return c;
-}
+        d->deferred = false;
 
-void server_client_write_pending(struct server_client *const c,
-    const bool write)
-{
-    c->write = write;
-}
+        if (prepare(s, d))
+        {
+            fprintf(stderr, "%s: prepare failed\n", __func__);
+            return -1;
+        }
 
-static volatile sig_atomic_t do_exit;
+        d = next;
+    }
 
-static void handle_signal(const int signum)
-{
-    switch (signum)
-    {
-        case SIGINT:
-            /* Fall through. */
-        case SIGTERM:
-            do_exit = 1;
-            break;
+    /* Do not block if some clients are ready already. */
+    const bool wait = !s->n_ready;
 
-        default:
+    while ((wait || pending_sqes(u)) && uring_enter(u, wait, timeout))
+    {
+        if (do_exit)
+        {
+            *exit = true;
+            return 0;
+        }
+        else if (errno == EBUSY)
+            /* Completions must be reaped first. */
             break;
+        else if (errno != EINTR)
+        {
+            fprintf(stderr, "%s: io_uring_enter(2): %s\n",
+                __func__, strerror(errno));
+            return -1;
+        }
     }
-}
 
-struct server_client *server_poll(struct server *const s, bool *const io,
+    unsigned head = *u->cq_head;
+    const unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++)
+        if (process_cqe(s, &u->cqes[head & *u->cq_mask], exit))
+        {
+            fprintf(stderr, "%s: process_cqe failed\n", __func__);
+            goto end;
+        }
+
+    ret = 0;
+
+end:
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    return ret;
+}
+#else
+static int backend_wait(struct server *const s, const int timeout,
     bool *const exit)
 {
-    struct server_client *ret = NULL;
-    const nfds_t n = s->n + 1;
-    struct pollfd *const fds = malloc(n * sizeof *fds);
+    int ret = -1;
+    nfds_t n = 2;
+    struct pollfd *const fds = malloc((s->n + n) * sizeof *fds);
+    bool busy;
 
     if (!fds)
     {
         fprintf(stderr, "%s: malloc(3): %s\n", __func__, strerror(errno));
         goto end;
     }
+    else if (carry_over(s, &busy))
+    {
+        fprintf(stderr, "%s: carry_over failed\n", __func__);
+        goto end;
+    }
 
-    struct pollfd *const sfd = &fds[0];
+    struct pollfd *const sfd = &fds[0], *const efd = &fds[1];
 
-    *io = *exit = false;
+    /* Negative file descriptors are ignored by poll(2). */
     *sfd = (const struct pollfd)
     {
-        .fd = s->fd,
+        .fd = s->stopped ? -1 : s->fd,
+        .events = POLLIN
+    };
+
+    *efd = (const struct pollfd)
+    {
+        .fd = *exit_pipe,
         .events = POLLIN
     };
 
-    for (size_t i = 0, j = 1; i < s->n; i++, j++)
+    for (size_t i = 0; i < s->n_slots; i++)
     {
-        struct pollfd *const p = &fds[j];
-        const struct server_client *const c = &s->c[i];
-        const int fd = c->fd;
+        const struct server_client *const c = s->c[i];
+
+        if (!c || c->suspended)
+            continue;
+
+        struct pollfd *const p = &fds[n++];
 
         *p = (const struct pollfd)
         {
-            .fd = fd,
+            .fd = c->fd,
             .events = POLLIN
         };
 
@@ -222,13 +1723,14 @@ struct server_client *server_poll(struct server *const s, bool *const io,
 
 again:
 
-    res = poll(fds, n, -1);
+    res = poll(fds, n, busy ? 0 : timeout);
 
     if (res < 0)
     {
         if (do_exit)
         {
             *exit = true;
+            ret = 0;
             goto end;
         }
 
@@ -246,37 +1748,95 @@ again:
 
         goto end;
     }
-    else if (!res)
-    {
-        fprintf(stderr, "%s: poll(2) returned zero\n", __func__);
-        goto end;
-    }
-
-    if (sfd->revents)
+    else if (efd->revents)
     {
-        ret = alloc_client(s);
+        *exit = true;
+        ret = 0;
         goto end;
     }
 
-    for (size_t i = 0, j = 1; i < s->n; i++, j++)
+    for (nfds_t i = 2; i < n; i++)
     {
-        const struct pollfd *const p = &fds[j];
-        struct server_client *const c = &s->c[i];
+        const struct pollfd *const p = &fds[i];
 
-        if (p->revents)
+        if (p->revents && add_ready(s, s->c[p->fd]))
         {
-            *io = true;
-            ret = c;
+            fprintf(stderr, "%s: add_ready failed\n", __func__);
             goto end;
         }
     }
 
-    fprintf(stderr, "%s: unlisted fd\n", __func__);
+    if (sfd->revents && accept_clients(s))
+    {
+        fprintf(stderr, "%s: accept_clients failed\n", __func__);
+        goto end;
+    }
+
+    ret = 0;
 
 end:
     free(fds);
     return ret;
 }
+#endif
+
+int server_poll(struct server *const s, struct server_client ***const c,
+    size_t *const n, const int timeout, bool *const exit)
+{
+    *exit = false;
+
+    /* Clients from the previous wakeup can be marked as ready again. */
+    for (size_t i = 0; i < s->n_ready; i++)
+        if (s->ready[i])
+            s->ready[i]->queued = false;
+
+    if (backend_wait(s, timeout, exit))
+    {
+        fprintf(stderr, "%s: backend_wait failed\n", __func__);
+        return -1;
+    }
+
+    *c = s->ready;
+    *n = s->n_ready;
+    return 0;
+}
+
+static int init_exit_pipe(void)
+{
+    if (*exit_pipe >= 0)
+        return 0;
+    else if (pipe(exit_pipe))
+    {
+        fprintf(stderr, "%s: pipe(2): %s\n", __func__, strerror(errno));
+        return -1;
+    }
+
+    for (size_t i = 0; i < sizeof exit_pipe / sizeof *exit_pipe; i++)
+    {
+        const int fd = exit_pipe[i], flags = fcntl(fd, F_GETFL);
+
+        if (flags < 0)
+        {
+            fprintf(stderr, "%s: fcntl(2) F_GETFL: %s\n",
+                __func__, strerror(errno));
+            return -1;
+        }
+        else if (fcntl(fd, F_SETFL, flags | O_NONBLOCK))
+        {
+            fprintf(stderr, "%s: fcntl(2) F_SETFL: %s\n",
+                __func__, strerror(errno));
+            return -1;
+        }
+        else if (fcntl(fd, F_SETFD, FD_CLOEXEC))
+        {
+            fprintf(stderr, "%s: fcntl(2) F_SETFD: %s\n",
+                __func__, strerror(errno));
+            return -1;
+        }
+    }
+
+    return 0;
+}
 
 static int init_signals(void)
 {
@@ -288,7 +1848,12 @@ static int init_signals(void)
 
     sigemptyset(&sa.sa_mask);
 
-    if (sigaction(SIGINT, &sa, NULL))
+    if (init_exit_pipe())
+    {
+        fprintf(stderr, "%s: init_exit_pipe failed\n", __func__);
+        return -1;
+    }
+    else if (sigaction(SIGINT, &sa, NULL))
     {
         fprintf(stderr, "%s: sigaction(2) SIGINT: %s\n",
             __func__, strerror(errno));
@@ -310,64 +1875,351 @@ static int init_signals(void)
     return 0;
 }
 
-struct server *server_init(const unsigned short port)
+unsigned short server_port(const struct server *const s)
+{
+    return s->port;
+}
+
+int server_fd(const struct server *const s)
+{
+    return s->fd;
+}
+
+union addr
+{
+    struct sockaddr sa;
+    struct sockaddr_in in;
+    struct sockaddr_in6 in6;
+    struct sockaddr_un un;
+};
+
+static int get_addr(const struct server_cfg *const cfg, union addr *const a,
+    socklen_t *const sz)
+{
+    const char *const addr = cfg->addr;
+
+    if (cfg->path)
+    {
+        if (strlen(cfg->path) >= sizeof a->un.sun_path)
+        {
+            fprintf(stderr, "%s: path too long: %s\n", __func__, cfg->path);
+            return -1;
+        }
+
+        a->un = (const struct sockaddr_un){.sun_family = AF_UNIX};
+        strcpy(a->un.sun_path, cfg->path);
+        *sz = sizeof a->un;
+    }
+    else if (!addr || inet_pton(AF_INET6, addr, &a->in6.sin6_addr) == 1)
+    {
+        const struct in6_addr in6 = addr ? a->in6.sin6_addr : in6addr_any;
+
+        a->in6 = (const struct sockaddr_in6)
+        {
+            .sin6_family = AF_INET6,
+            .sin6_port = htons(cfg->port),
+            .sin6_addr = in6
+        };
+
+        *sz = sizeof a->in6;
+    }
+    else if (inet_pton(AF_INET, addr, &a->in.sin_addr) == 1)
+    {
+        const struct in_addr in = a->in.sin_addr;
+
+        a->in = (const struct sockaddr_in)
+        {
+            .sin_family = AF_INET,
+            .sin_port = htons(cfg->port),
+            .sin_addr = in
+        };
+
+        *sz = sizeof a->in;
+    }
+    else
+    {
+        fprintf(stderr, "%s: invalid IPv4 or IPv6 address: %s\n",
+            __func__, addr);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int set_tcp_options(const int fd, const struct server_cfg *const cfg)
+{
+    if (cfg->defer_accept)
+    {
+#ifdef TCP_DEFER_ACCEPT
+        /* Connections are not reported by accept(2) until data arrives,
+         * so idle connections do not wake up the event loop. */
+        const int secs = cfg->defer_accept > INT_MAX ?
+            INT_MAX : cfg->defer_accept;
+
+        if (setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &secs, sizeof secs))
+        {
+            fprintf(stderr, "%s: setsockopt(2) TCP_DEFER_ACCEPT: %s\n",
+                __func__, strerror(errno));
+            return -1;
+        }
+#else
+        fprintf(stderr, "%s: TCP_DEFER_ACCEPT not supported\n", __func__);
+        return -1;
+#endif
+    }
+
+    if (cfg->fastopen)
+    {
+#ifdef TCP_FASTOPEN
+        /* Allows returning clients to send their request along with the
+         * SYN, saving one round trip. */
+        const int qlen = cfg->fastopen > INT_MAX ? INT_MAX : cfg->fastopen;
+
+        if (setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof qlen))
+        {
+            fprintf(stderr, "%s: setsockopt(2) TCP_FASTOPEN: %s\n",
+                __func__, strerror(errno));
+            return -1;
+        }
+#else
+        fprintf(stderr, "%s: TCP_FASTOPEN not supported\n", __func__);
+        return -1;
+#endif
+    }
+
+    return 0;
+}
+
+static int new_socket(const struct server_cfg *const cfg, union addr *const a,
+    socklen_t *const sz)
+{
+    if (get_addr(cfg, a, sz))
+    {
+        fprintf(stderr, "%s: get_addr failed\n", __func__);
+        return -1;
+    }
+
+    int fd = socket(a->sa.sa_family, SOCK_STREAM, 0);
+
+    /* Listen to every IPv4 address if IPv6 is not available. */
+    if (fd < 0 && errno == EAFNOSUPPORT && !cfg->path && !cfg->addr)
+    {
+        a->in = (const struct sockaddr_in)
+        {
+            .sin_family = AF_INET,
+            .sin_port = htons(cfg->port)
+        };
+
+        *sz = sizeof a->in;
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+    }
+
+    if (fd < 0)
+    {
+        fprintf(stderr, "%s: socket(2): %s\n", __func__, strerror(errno));
+        return -1;
+    }
+    else if (a->sa.sa_family == AF_INET6)
+    {
+        /* Accept IPv4 connections as well, as IPv4-mapped addresses. */
+        const int off = 0;
+
+        if (setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof off))
+        {
+            fprintf(stderr, "%s: setsockopt(2) IPV6_V6ONLY: %s\n",
+                __func__, strerror(errno));
+            goto failure;
+        }
+    }
+
+    if (cfg->reuseport)
+    {
+#ifdef SO_REUSEPORT
+        /* Allow several listening sockets bound to the same port, so that
+         * the kernel distributes incoming connections among them. */
+        const int on = 1;
+
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof on))
+        {
+            fprintf(stderr, "%s: setsockopt(2) SO_REUSEPORT: %s\n",
+                __func__, strerror(errno));
+            goto failure;
+        }
+#else
+        fprintf(stderr, "%s: SO_REUSEPORT not supported\n", __func__);
+        goto failure;
+#endif
+    }
+
+    if (!cfg->path && set_tcp_options(fd, cfg))
+    {
+        fprintf(stderr, "%s: set_tcp_options failed\n", __func__);
+        goto failure;
+    }
+
+    return fd;
+
+failure:
+
+    if (close(fd))
+        fprintf(stderr, "%s: close(2): %s\n", __func__, strerror(errno));
+
+    return -1;
+}
+
+/* Sockets left behind by a previous instance would make bind(2) fail. */
+static int remove_stale(const char *const path)
+{
+    struct stat sb;
+
+    if (stat(path, &sb))
+    {
+        if (errno == ENOENT)
+            return 0;
+
+        fprintf(stderr, "%s: stat(2) %s: %s\n",
+            __func__, path, strerror(errno));
+        return -1;
+    }
+    else if (!S_ISSOCK(sb.st_mode))
+    {
+        fprintf(stderr, "%s: %s exists and is not a socket\n",
+            __func__, path);
+        return -1;
+    }
+    else if (unlink(path))
+    {
+        fprintf(stderr, "%s: unlink(2) %s: %s\n",
+            __func__, path, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+struct server *server_init_fd(const int fd)
 {
     struct server *const s = malloc(sizeof *s);
 
     if (!s)
     {
         fprintf(stderr, "%s: malloc(3): %s\n", __func__, strerror(errno));
-        goto failure;
+
+        if (close(fd))
+            fprintf(stderr, "%s: close(2): %s\n", __func__, strerror(errno));
+
+        return NULL;
     }
 
     *s = (const struct server)
     {
-        .fd = socket(AF_INET, SOCK_STREAM, 0)
+        .fd = fd,
+#if defined(SLCL_EPOLL)
+        .epfd = -1
+#elif defined(SLCL_IO_URING)
+        .u.fd = -1
+#endif
     };
 
-    if (s->fd < 0)
+    if (init_signals())
     {
-        fprintf(stderr, "%s: socket(2): %s\n", __func__, strerror(errno));
+        fprintf(stderr, "%s: init_signals failed\n", __func__);
         goto failure;
     }
-    else if (init_signals())
+    /* Pending connections are accepted until accept(2) would block. */
+    else if (set_nonblock(s->fd))
     {
-        fprintf(stderr, "%s: init_signals failed\n", __func__);
+        fprintf(stderr, "%s: set_nonblock failed\n", __func__);
+        goto failure;
+    }
+    else if (backend_init(s))
+    {
+        fprintf(stderr, "%s: backend_init failed\n", __func__);
         goto failure;
     }
 
-    const struct sockaddr_in addr =
+    union addr a;
+    socklen_t sz = sizeof a;
+
+    if (getsockname(s->fd, &a.sa, &sz))
     {
-        .sin_family = AF_INET,
-        .sin_port = htons(port)
-    };
+        fprintf(stderr, "%s: getsockname(2): %s\n", __func__, strerror(errno));
+        goto failure;
+    }
+
+    switch (a.sa.sa_family)
+    {
+        case AF_INET:
+            s->port = ntohs(a.in.sin_port);
+            break;
+
+        case AF_INET6:
+            s->port = ntohs(a.in6.sin6_port);
+            break;
+
+        default:
+            break;
+    }
+
+    return s;
+
+failure:
+    server_close(s);
+    return NULL;
+}
 
-    enum {QUEUE_LEN = 10};
+struct server *server_init(const struct server_cfg *const cfg)
+{
+    union addr a;
+    socklen_t sz;
+    struct server *s;
+    const int fd = new_socket(cfg, &a, &sz);
 
-    if (bind(s->fd, (const struct sockaddr *)&addr, sizeof addr))
+    if (fd < 0)
+    {
+        fprintf(stderr, "%s: new_socket failed\n", __func__);
+        return NULL;
+    }
+    else if (cfg->path && remove_stale(cfg->path))
+    {
+        fprintf(stderr, "%s: remove_stale failed\n", __func__);
+        goto failure;
+    }
+    else if (bind(fd, &a.sa, sz))
     {
         fprintf(stderr, "%s: bind(2): %s\n", __func__, strerror(errno));
         goto failure;
     }
-    else if (listen(s->fd, QUEUE_LEN))
+    else if (listen(fd, cfg->backlog ? cfg->backlog : SOMAXCONN))
     {
         fprintf(stderr, "%s: listen(2): %s\n", __func__, strerror(errno));
         goto failure;
     }
-
-    struct sockaddr_in in;
-    socklen_t sz = sizeof in;
-
-    if (getsockname(s->fd, (struct sockaddr *)&in, &sz))
+    else if (!(s = server_init_fd(fd)))
     {
-        fprintf(stderr, "%s: getsockname(2): %s\n", __func__, strerror(errno));
-        goto failure;
+        fprintf(stderr, "%s: server_init_fd failed\n", __func__);
+        return NULL;
     }
+    else if (cfg->path)
+    {
+        if (!(s->path = strdup(cfg->path)))
+        {
+            fprintf(stderr, "%s: strdup(3): %s\n", __func__, strerror(errno));
+            server_close(s);
+            return NULL;
+        }
+
+        printf("Listening on %s\n", s->path);
+    }
+    else
+        printf("Listening on port %hu\n", s->port);
 
-    printf("Listening on port %hu\n", ntohs(in.sin_port));
     return s;
 
 failure:
-    server_close(s);
+
+    if (close(fd))
+        fprintf(stderr, "%s: close(2): %s\n", __func__, strerror(errno));
+
     return NULL;
 }
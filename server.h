@@ -1,15 +1,85 @@
 #ifndef SERVER_H
 #define SERVER_H
 
+#include <sys/types.h>
+#include <sys/uio.h>
 #include <stdbool.h>
 #include <stddef.h>
 
-struct server *server_init(unsigned short port);
-struct server_client *server_poll(struct server *s, bool *io, bool *exit);
+struct server_client;
+
+struct server_cfg
+{
+    /* Path to an AF_UNIX stream socket. Otherwise, a TCP socket is bound
+     * to addr and port. */
+    const char *path;
+    /* Numeric IPv4 or IPv6 address. NULL listens to every IPv4 and IPv6
+     * address. */
+    const char *addr;
+    unsigned short port;
+    /* Maximum length of the queue of pending connections. Zero selects
+     * SOMAXCONN. */
+    int backlog;
+    /* Optional TCP listener settings, where zero disables them: seconds
+     * to wait for data from new connections before reporting them, via
+     * TCP_DEFER_ACCEPT, and maximum length of the TCP_FASTOPEN queue. */
+    unsigned long defer_accept, fastopen;
+    /* Allows several servers to listen to the same port. */
+    bool reuseport;
+};
+
+struct server *server_init(const struct server_cfg *cfg);
+/* Same as server_init, but fd is an already listening socket e.g.: one
+ * shared with another server. fd is closed on failure. */
+struct server *server_init_fd(int fd);
+int server_fd(const struct server *s);
+/* Zero for AF_UNIX sockets. */
+unsigned short server_port(const struct server *s);
+/* Returns the set of clients ready for I/O into c, whose contents remain
+ * valid until the next call. Closed clients are set to NULL. timeout is
+ * given in milliseconds, and negative values block indefinitely. */
+int server_poll(struct server *s, struct server_client ***c, size_t *n,
+    int timeout, bool *exit);
 int server_read(void *buf, size_t n, struct server_client *c);
 int server_write(const void *buf, size_t n, struct server_client *c);
+/* Same as server_write, but data is gathered from iov as in writev(2). */
+int server_writev(const struct iovec *iov, int n, struct server_client *c);
+/* Writes up to n bytes from fd, starting at *off, which is updated,
+ * without copying them into user space. Fails with ENOSYS where not
+ * supported. */
+int server_sendfile(int fd, off_t *off, size_t n, struct server_client *c);
+/* Writes n bytes from buf into fd, a regular file, at offset off on behalf
+ * of c. The io_uring(7) backend writes in the background from a copy of
+ * buf, so server_client_sync must be called before the file is used. */
+int server_pwrite(int fd, const void *buf, size_t n, off_t off,
+    struct server_client *c);
 int server_close(struct server *s);
+/* Stops accepting new connections, while existing clients are still
+ * polled e.g.: after the listening socket was handed over to another
+ * process. */
+int server_stop_accept(struct server *s);
+/* Connections might still be accepted after server_stop_accept until this
+ * returns false, which might take until the next call to server_poll. */
+bool server_accepting(const struct server *s);
+/* Makes every server return from server_poll with exit set.
+ * Async-signal-safe. */
+void server_shutdown(void);
+/* Polls fd for reading along with the rest of clients e.g.: a pipe used to
+ * receive notifications from other threads. fd is closed on failure. */
+struct server_client *server_client_add(struct server *s, int fd);
 int server_client_close(struct server *s, struct server_client *c);
+void server_client_set_user(struct server_client *c, void *user);
+void *server_client_user(const struct server_client *c);
 void server_client_write_pending(struct server_client *c, bool write);
+/* Suspended clients are not polled until resumed. */
+void server_client_suspend(struct server_client *c, bool suspend);
+/* Whether c can still be serviced during the current wakeup i.e., no I/O
+ * operation would block and its byte budget has not been exhausted. */
+bool server_client_ready(const struct server_client *c);
+/* Returns zero once every write from server_pwrite for c has completed,
+ * or a negative value if any of them failed. Otherwise, a positive value
+ * is returned and c is suspended until they complete, after which it is
+ * returned by server_poll. */
+int server_client_sync(struct server_client *c);
 
 #endif /* SERVER_H */
@@ -0,0 +1,446 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "sidecar.h"
+#include "cftw.h"
+#include <dynstr.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+enum
+{
+    /* Seconds between scans. */
+    INTERVAL = 60,
+    /* Seconds since their last modification after which temporary files
+     * are assumed to be left behind, rather than still being written by
+     * another process, such as during a handover. */
+    GRACE = 5 * INTERVAL
+};
+
+struct sidecar
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t thread;
+    bool exit;
+    unsigned long long min;
+    struct dynstr user, dir;
+};
+
+static bool exiting(struct sidecar *const s)
+{
+    pthread_mutex_lock(&s->mutex);
+
+    const bool ret = s->exit;
+
+    pthread_mutex_unlock(&s->mutex);
+    return ret;
+}
+
+/* Creates every missing directory from path, up to its last component,
+ * assuming those up to s->dir exist. */
+static int make_dirs(const struct sidecar *const s, char *const path)
+{
+    for (char *p = strchr(path + s->dir.len + 1, '/'); p;
+        p = strchr(p + 1, '/'))
+    {
+        *p = '\0';
+
+        const bool failed = mkdir(path, S_IRWXU) && errno != EEXIST;
+
+        if (failed)
+            fprintf(stderr, "%s: mkdir(2) %s: %s\n",
+                __func__, path, strerror(errno));
+
+        *p = '/';
+
+        if (failed)
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Text files are assumed to contain no null bytes. */
+static int is_text(FILE *const f, bool *const text)
+{
+    char buf[BUFSIZ];
+    const size_t n = fread(buf, 1, sizeof buf, f);
+
+    if (ferror(f))
+    {
+        fprintf(stderr, "%s: fread(3) failed\n", __func__);
+        return -1;
+    }
+
+    *text = !memchr(buf, '\0', n);
+    rewind(f);
+    return 0;
+}
+
+static int write_gzip(FILE *const f, const int fd)
+{
+    gzFile gz = gzdopen(fd, "wb");
+
+    if (!gz)
+    {
+        fprintf(stderr, "%s: gzdopen failed\n", __func__);
+
+        if (close(fd))
+            fprintf(stderr, "%s: close(2): %s\n", __func__, strerror(errno));
+
+        return -1;
+    }
+
+    char buf[BUFSIZ];
+    size_t n;
+
+    while ((n = fread(buf, 1, sizeof buf, f)))
+        if (gzwrite(gz, buf, n) != n)
+        {
+            fprintf(stderr, "%s: gzwrite failed\n", __func__);
+            gzclose(gz);
+            return -1;
+        }
+
+    if (ferror(f))
+    {
+        fprintf(stderr, "%s: fread(3) failed\n", __func__);
+        gzclose(gz);
+        return -1;
+    }
+    else if (gzclose(gz) != Z_OK)
+    {
+        fprintf(stderr, "%s: gzclose failed\n", __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* The sidecar is written into a temporary file first, so that clients
+ * never get an incomplete one. Its modification time is copied from src,
+ * so that it is only used for this version of src. */
+static int create_sidecar(const char *const src, const char *const dst,
+    const struct stat *const sb)
+{
+    int ret = -1;
+    FILE *const f = fopen(src, "rb");
+    struct dynstr tmp;
+    struct stat nsb;
+    bool text;
+
+    dynstr_init(&tmp);
+
+    if (!f)
+    {
+        fprintf(stderr, "%s: fopen(3) %s: %s\n", __func__, src,
+            strerror(errno));
+        goto end;
+    }
+    else if (is_text(f, &text))
+    {
+        fprintf(stderr, "%s: is_text failed\n", __func__);
+        goto end;
+    }
+    else if (!text)
+    {
+        ret = 0;
+        goto end;
+    }
+    else if (dynstr_append(&tmp, "%s.XXXXXX", dst))
+    {
+        fprintf(stderr, "%s: dynstr_append failed\n", __func__);
+        goto end;
+    }
+
+    const int fd = mkstemp(tmp.str);
+
+    if (fd < 0)
+    {
+        fprintf(stderr, "%s: mkstemp(3): %s\n", __func__, strerror(errno));
+        goto end;
+    }
+    else if (write_gzip(f, fd))
+    {
+        fprintf(stderr, "%s: write_gzip failed\n", __func__);
+        goto discard;
+    }
+    else if (stat(src, &nsb))
+    {
+        fprintf(stderr, "%s: stat(2) %s: %s\n", __func__, src,
+            strerror(errno));
+        goto discard;
+    }
+    /* Modified while compressed, so it will be retried on the next
+     * scan. */
+    else if (nsb.st_size != sb->st_size
+        || nsb.st_mtim.tv_sec != sb->st_mtim.tv_sec
+        || nsb.st_mtim.tv_nsec != sb->st_mtim.tv_nsec)
+    {
+        ret = 0;
+        goto discard;
+    }
+    else if (utimensat(AT_FDCWD, tmp.str, (const struct timespec[])
+        {
+            {.tv_nsec = UTIME_OMIT},
+            sb->st_mtim
+        }, 0))
+    {
+        fprintf(stderr, "%s: utimensat(2) %s: %s\n", __func__, tmp.str,
+            strerror(errno));
+        goto discard;
+    }
+    else if (rename(tmp.str, dst))
+    {
+        fprintf(stderr, "%s: rename(2) %s: %s\n", __func__, dst,
+            strerror(errno));
+        goto discard;
+    }
+
+    ret = 0;
+    goto end;
+
+discard:
+    if (remove(tmp.str))
+        fprintf(stderr, "%s: remove(3) %s: %s\n", __func__, tmp.str,
+            strerror(errno));
+
+end:
+    if (f && fclose(f))
+    {
+        fprintf(stderr, "%s: fclose(3): %s\n", __func__, strerror(errno));
+        ret = -1;
+    }
+
+    dynstr_free(&tmp);
+    return ret;
+}
+
+static bool same_time(const struct timespec *const a,
+    const struct timespec *const b)
+{
+    return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+static int create(const char *const fpath, const struct stat *const sb,
+    void *const user)
+{
+    struct sidecar *const s = user;
+    struct dynstr d;
+    struct stat dsb;
+
+    if (exiting(s))
+        return 1;
+    else if (sb->st_size < s->min)
+        return 0;
+
+    dynstr_init(&d);
+
+    if (dynstr_append(&d, "%s%s.gz", s->dir.str, fpath + s->user.len))
+    {
+        fprintf(stderr, "%s: dynstr_append failed\n", __func__);
+        return -1;
+    }
+    else if (!stat(d.str, &dsb) && same_time(&dsb.st_mtim, &sb->st_mtim))
+        ;
+    /* Failures are limited to this file, so others are still looked
+     * at. */
+    else if (make_dirs(s, d.str))
+        fprintf(stderr, "%s: make_dirs failed\n", __func__);
+    else if (create_sidecar(fpath, d.str, sb))
+        fprintf(stderr, "%s: create_sidecar %s failed\n", __func__, fpath);
+
+    dynstr_free(&d);
+    return 0;
+}
+
+/* Removes sidecars whose file no longer exists, as well as temporary
+ * files left behind for longer than GRACE. */
+static int prune(const char *const fpath, const struct stat *const sb,
+    void *const user)
+{
+    static const char *const exts[] = {".gz", ".zst"};
+    struct sidecar *const s = user;
+    const size_t len = strlen(fpath);
+    size_t ext = 0;
+    struct stat fsb;
+
+    if (exiting(s))
+        return 1;
+
+    for (size_t i = 0; i < sizeof exts / sizeof *exts; i++)
+    {
+        const size_t n = strlen(exts[i]);
+
+        if (len > n && !strcmp(fpath + len - n, exts[i]))
+        {
+            ext = n;
+            break;
+        }
+    }
+
+    if (ext)
+    {
+        struct dynstr d;
+
+        dynstr_init(&d);
+
+        if (dynstr_append(&d, "%s%.*s", s->user.str,
+            (int)(len - ext - s->dir.len), fpath + s->dir.len))
+        {
+            fprintf(stderr, "%s: dynstr_append failed\n", __func__);
+            return -1;
+        }
+
+        const bool gone = stat(d.str, &fsb)
+            && (errno == ENOENT || errno == ENOTDIR);
+
+        dynstr_free(&d);
+
+        if (!gone)
+            return 0;
+    }
+    else if (time(NULL) - sb->st_mtime < GRACE)
+        return 0;
+
+    if (remove(fpath))
+        fprintf(stderr, "%s: remove(3) %s: %s\n", __func__, fpath,
+            strerror(errno));
+
+    return 0;
+}
+
+static void *run(void *const arg)
+{
+    struct sidecar *const s = arg;
+
+    for (;;)
+    {
+        if (cftw(s->dir.str, prune, s) < 0)
+            fprintf(stderr, "%s: cftw %s failed\n", __func__, s->dir.str);
+        else if (cftw(s->user.str, create, s) < 0)
+            fprintf(stderr, "%s: cftw %s failed\n", __func__, s->user.str);
+
+        struct timespec ts;
+
+        if (clock_gettime(CLOCK_REALTIME, &ts))
+        {
+            fprintf(stderr, "%s: clock_gettime(2): %s\n",
+                __func__, strerror(errno));
+            break;
+        }
+
+        ts.tv_sec += INTERVAL;
+        pthread_mutex_lock(&s->mutex);
+
+        int error = 0;
+
+        while (!s->exit && error != ETIMEDOUT)
+            error = pthread_cond_timedwait(&s->cond, &s->mutex, &ts);
+
+        const bool done = s->exit;
+
+        pthread_mutex_unlock(&s->mutex);
+
+        if (done)
+            break;
+    }
+
+    return NULL;
+}
+
+void sidecar_free(struct sidecar *const s)
+{
+    if (!s)
+        return;
+
+    pthread_mutex_lock(&s->mutex);
+    s->exit = true;
+    pthread_cond_signal(&s->cond);
+    pthread_mutex_unlock(&s->mutex);
+
+    const int error = pthread_join(s->thread, NULL);
+
+    if (error)
+        fprintf(stderr, "%s: pthread_join(3): %s\n", __func__,
+            strerror(error));
+
+    pthread_cond_destroy(&s->cond);
+    pthread_mutex_destroy(&s->mutex);
+    dynstr_free(&s->user);
+    dynstr_free(&s->dir);
+    free(s);
+}
+
+struct sidecar *sidecar_alloc(const char *const dir,
+    const unsigned long long min)
+{
+    int error;
+    struct sidecar *const s = malloc(sizeof *s);
+
+    if (!s)
+    {
+        fprintf(stderr, "%s: malloc(3): %s\n", __func__, strerror(errno));
+        return NULL;
+    }
+
+    *s = (const struct sidecar)
+    {
+        .min = min
+    };
+
+    dynstr_init(&s->user);
+    dynstr_init(&s->dir);
+
+    if (dynstr_append(&s->user, "%s/user", dir)
+        || dynstr_append(&s->dir, "%s/sidecar", dir))
+    {
+        fprintf(stderr, "%s: dynstr_append failed\n", __func__);
+        goto failure;
+    }
+    else if (mkdir(s->dir.str, S_IRWXU) && errno != EEXIST)
+    {
+        fprintf(stderr, "%s: mkdir(2) %s: %s\n", __func__, s->dir.str,
+            strerror(errno));
+        goto failure;
+    }
+    else if ((error = pthread_mutex_init(&s->mutex, NULL)))
+    {
+        fprintf(stderr, "%s: pthread_mutex_init(3): %s\n",
+            __func__, strerror(error));
+        goto failure;
+    }
+    else if ((error = pthread_cond_init(&s->cond, NULL)))
+    {
+        fprintf(stderr, "%s: pthread_cond_init(3): %s\n",
+            __func__, strerror(error));
+        pthread_mutex_destroy(&s->mutex);
+        goto failure;
+    }
+    else if ((error = pthread_create(&s->thread, NULL, run, s)))
+    {
+        fprintf(stderr, "%s: pthread_create(3): %s\n",
+            __func__, strerror(error));
+        pthread_cond_destroy(&s->cond);
+        pthread_mutex_destroy(&s->mutex);
+        goto failure;
+    }
+
+    return s;
+
+failure:
+    dynstr_free(&s->user);
+    dynstr_free(&s->dir);
+    free(s);
+    return NULL;
+}
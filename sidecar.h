@@ -0,0 +1,13 @@
+#ifndef SIDECAR_H
+#define SIDECAR_H
+
+/* Compressed copies of text files from dir/user, or sidecars, are kept
+ * under dir/sidecar with the same tree, so that they are never listed nor
+ * counted towards user quotas. A background thread periodically creates
+ * gzip sidecars for files of at least min bytes and removes those whose
+ * file no longer exists. */
+struct sidecar *sidecar_alloc(const char *dir, unsigned long long min);
+/* Blocks until the background thread is finished. */
+void sidecar_free(struct sidecar *s);
+
+#endif /* SIDECAR_H */
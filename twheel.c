@@ -0,0 +1,178 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "twheel.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Each level covers SLOTS times the range from the previous one, so
+ * timers up to 2^24 ticks ahead are supported. Later timers are kept on
+ * the last level until they get closer. */
+enum {BITS = 6, SLOTS = 1 << BITS, LEVELS = 4};
+
+struct twheel
+{
+    /* Every tick before now has already been processed. */
+    unsigned long long now;
+    struct twheel_timer *slots[LEVELS][SLOTS], *expired;
+};
+
+static void push(struct twheel_timer **const head,
+    struct twheel_timer *const t)
+{
+    if ((t->next = *head))
+        t->next->pprev = &t->next;
+
+    t->pprev = head;
+    *head = t;
+}
+
+static void link_timer(struct twheel *const w, struct twheel_timer *const t)
+{
+    const unsigned long long max = (1ull << BITS * LEVELS) - 1,
+        delta = t->expiry > w->now ? t->expiry - w->now : 0,
+        d = delta > max ? max : delta,
+        when = w->now + d;
+    size_t level = 0;
+
+    while (level < LEVELS - 1 && d >> BITS * (level + 1))
+        level++;
+
+    push(&w->slots[level][when >> BITS * level & (SLOTS - 1)], t);
+}
+
+void twheel_cancel(struct twheel_timer *const t)
+{
+    if (t->pprev)
+    {
+        if ((*t->pprev = t->next))
+            t->next->pprev = t->pprev;
+
+        t->next = NULL;
+        t->pprev = NULL;
+    }
+}
+
+bool twheel_pending(const struct twheel_timer *const t)
+{
+    return t->pprev;
+}
+
+void twheel_add(struct twheel *const w, struct twheel_timer *const t,
+    const unsigned long long expiry)
+{
+    twheel_cancel(t);
+    t->expiry = expiry;
+    link_timer(w, t);
+}
+
+unsigned long long twheel_next(struct twheel *const w)
+{
+    unsigned long long ret = ULLONG_MAX;
+
+    if (w->expired)
+        return 0;
+
+    for (unsigned i = 0; i < SLOTS; i++)
+        if (w->slots[0][(w->now + i) & (SLOTS - 1)])
+        {
+            ret = w->now + i;
+            break;
+        }
+
+    for (size_t l = 1; l < LEVELS; l++)
+        for (unsigned i = 0; i < SLOTS; i++)
+            if (w->slots[l][i])
+            {
+                /* Upper levels are looked at again every SLOTS ticks. */
+                const unsigned long long c =
+                    (w->now + SLOTS - 1) & ~(unsigned long long)(SLOTS - 1);
+
+                return c < ret ? c : ret;
+            }
+
+    return ret;
+}
+
+static void process_tick(struct twheel *const w)
+{
+    const unsigned long long now = w->now;
+
+    /* Timers from upper levels are moved down once their slot is reached,
+     * which never places them back into the slot being processed. */
+    for (size_t l = 1; l < LEVELS && !(now & ((1ull << BITS * l) - 1)); l++)
+    {
+        struct twheel_timer **const head =
+            &w->slots[l][now >> BITS * l & (SLOTS - 1)];
+
+        while (*head)
+        {
+            struct twheel_timer *const t = *head;
+
+            twheel_cancel(t);
+            link_timer(w, t);
+        }
+    }
+
+    struct twheel_timer **const head = &w->slots[0][now & (SLOTS - 1)];
+
+    while (*head)
+    {
+        struct twheel_timer *const t = *head;
+
+        twheel_cancel(t);
+        push(&w->expired, t);
+    }
+
+    w->now++;
+}
+
+struct twheel_timer *twheel_expired(struct twheel *const w,
+    const unsigned long long now)
+{
+    while (!w->expired && w->now <= now)
+    {
+        const unsigned long long next = twheel_next(w);
+
+        /* Ticks without timers are skipped. */
+        if (next > now)
+        {
+            w->now = now + 1;
+            break;
+        }
+        else if (next > w->now)
+            w->now = next;
+
+        process_tick(w);
+    }
+
+    struct twheel_timer *const t = w->expired;
+
+    if (t)
+        twheel_cancel(t);
+
+    return t;
+}
+
+void twheel_free(struct twheel *const w)
+{
+    free(w);
+}
+
+struct twheel *twheel_alloc(const unsigned long long now)
+{
+    struct twheel *const w = calloc(1, sizeof *w);
+
+    if (!w)
+    {
+        fprintf(stderr, "%s: calloc(3): %s\n", __func__, strerror(errno));
+        return NULL;
+    }
+
+    w->now = now;
+    return w;
+}
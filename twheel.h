@@ -0,0 +1,32 @@
+#ifndef TWHEEL_H
+#define TWHEEL_H
+
+#include <stdbool.h>
+
+/* Hierarchical timer wheel, so that timers are armed and cancelled in
+ * constant time regardless of the number of timers. Time is measured in
+ * ticks, whose duration is defined by the caller. */
+struct twheel_timer
+{
+    struct twheel_timer *next, **pprev;
+    unsigned long long expiry;
+    void *user;
+};
+
+struct twheel *twheel_alloc(unsigned long long now);
+void twheel_free(struct twheel *w);
+/* t expires on the given tick. Armed timers are rescheduled. Timers must
+ * be zero-initialized before first use. */
+void twheel_add(struct twheel *w, struct twheel_timer *t,
+    unsigned long long expiry);
+void twheel_cancel(struct twheel_timer *t);
+bool twheel_pending(const struct twheel_timer *t);
+/* Returns a timer that expired on or before now, or NULL if none. Returned
+ * timers are no longer armed. */
+struct twheel_timer *twheel_expired(struct twheel *w, unsigned long long now);
+/* Returns the tick on which timers might expire next, which might be
+ * earlier than the actual expiry of any timer. Returns ULLONG_MAX if no
+ * timers are armed. */
+unsigned long long twheel_next(struct twheel *w);
+
+#endif /* TWHEEL_H */
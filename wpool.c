@@ -0,0 +1,181 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "wpool.h"
+#include <pthread.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct wpool
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t *threads;
+    size_t n_threads;
+    bool exit;
+
+    /* Circular buffer. */
+    struct job
+    {
+        void (*fn)(void *);
+        void *arg;
+    } *jobs;
+
+    size_t head, n, max;
+};
+
+static void *run(void *const arg)
+{
+    struct wpool *const p = arg;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&p->mutex);
+
+        while (!p->exit && !p->n)
+            pthread_cond_wait(&p->cond, &p->mutex);
+
+        if (p->exit)
+        {
+            pthread_mutex_unlock(&p->mutex);
+            break;
+        }
+
+        const struct job j = p->jobs[p->head];
+
+        p->head = (p->head + 1) % p->max;
+        p->n--;
+        pthread_mutex_unlock(&p->mutex);
+        j.fn(j.arg);
+    }
+
+    return NULL;
+}
+
+int wpool_push(struct wpool *const p, void (*const fn)(void *),
+    void *const arg)
+{
+    int ret = -1, error;
+
+    if ((error = pthread_mutex_lock(&p->mutex)))
+    {
+        fprintf(stderr, "%s: pthread_mutex_lock(3): %s\n",
+            __func__, strerror(error));
+        return -1;
+    }
+    else if (p->n >= p->max)
+    {
+        ret = 1;
+        goto end;
+    }
+
+    p->jobs[(p->head + p->n++) % p->max] = (const struct job)
+    {
+        .fn = fn,
+        .arg = arg
+    };
+
+    if ((error = pthread_cond_signal(&p->cond)))
+    {
+        fprintf(stderr, "%s: pthread_cond_signal(3): %s\n",
+            __func__, strerror(error));
+        goto end;
+    }
+
+    ret = 0;
+
+end:
+    pthread_mutex_unlock(&p->mutex);
+    return ret;
+}
+
+void wpool_free(struct wpool *const p)
+{
+    if (!p)
+        return;
+
+    pthread_mutex_lock(&p->mutex);
+    p->exit = true;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->mutex);
+
+    for (size_t i = 0; i < p->n_threads; i++)
+    {
+        const int error = pthread_join(p->threads[i], NULL);
+
+        if (error)
+            fprintf(stderr, "%s: pthread_join(3): %s\n",
+                __func__, strerror(error));
+    }
+
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->mutex);
+    free(p->threads);
+    free(p->jobs);
+    free(p);
+}
+
+struct wpool *wpool_alloc(const size_t n_threads, const size_t max_jobs)
+{
+    int error;
+    struct wpool *const p = malloc(sizeof *p);
+
+    if (!p)
+    {
+        fprintf(stderr, "%s: malloc(3): %s\n", __func__, strerror(errno));
+        return NULL;
+    }
+
+    *p = (const struct wpool)
+    {
+        .max = max_jobs
+    };
+
+    if ((error = pthread_mutex_init(&p->mutex, NULL)))
+    {
+        fprintf(stderr, "%s: pthread_mutex_init(3): %s\n",
+            __func__, strerror(error));
+        free(p);
+        return NULL;
+    }
+    else if ((error = pthread_cond_init(&p->cond, NULL)))
+    {
+        fprintf(stderr, "%s: pthread_cond_init(3): %s\n",
+            __func__, strerror(error));
+        pthread_mutex_destroy(&p->mutex);
+        free(p);
+        return NULL;
+    }
+    else if (!(p->jobs = malloc(max_jobs * sizeof *p->jobs)))
+    {
+        fprintf(stderr, "%s: malloc(3) jobs: %s\n", __func__, strerror(errno));
+        goto failure;
+    }
+    else if (!(p->threads = malloc(n_threads * sizeof *p->threads)))
+    {
+        fprintf(stderr, "%s: malloc(3) threads: %s\n",
+            __func__, strerror(errno));
+        goto failure;
+    }
+
+    for (; p->n_threads < n_threads; p->n_threads++)
+    {
+        pthread_t *const t = &p->threads[p->n_threads];
+
+        if ((error = pthread_create(t, NULL, run, p)))
+        {
+            fprintf(stderr, "%s: pthread_create(3): %s\n",
+                __func__, strerror(error));
+            goto failure;
+        }
+    }
+
+    return p;
+
+failure:
+    wpool_free(p);
+    return NULL;
+}
@@ -0,0 +1,16 @@
+#ifndef WPOOL_H
+#define WPOOL_H
+
+#include <stddef.h>
+
+/* Fixed-size pool of worker threads that run jobs from a bounded queue,
+ * so that blocking operations do not stall the event loop. */
+struct wpool *wpool_alloc(size_t n_threads, size_t max_jobs);
+/* Jobs still queued when called are discarded. Blocks until running jobs
+ * are finished. */
+void wpool_free(struct wpool *p);
+/* Returns zero on success, a positive value if the queue is full or a
+ * negative value on fatal error. */
+int wpool_push(struct wpool *p, void (*fn)(void *), void *arg);
+
+#endif /* WPOOL_H */